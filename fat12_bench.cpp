@@ -0,0 +1,327 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include <fcntl.h>
+#include <unistd.h>
+#include "fat12_file_system.h"
+
+using namespace std;
+
+// Benchmark driver for the core operations. For every block size and fill
+// level it builds a fresh image, fills it, and times each operation on one
+// open session, the way batch mode runs them. Results go to stdout as JSON.
+
+typedef struct BenchConfig {
+    vector<uint32_t> blockSizes;
+    vector<double> fillLevels;  // Fraction of the data blocks in use before timing
+    double fragmentation;       // Fraction of the fill punched into 1-block holes
+    uint32_t operations;        // Timed calls per operation
+    uint32_t fileSize;          // Bytes per file for write and read
+    uint32_t fillFileBlocks;    // Blocks per file used to fill the image
+    StorageBackend backend;
+    string workDir;
+} BenchConfig;
+
+typedef struct BenchResult {
+    uint32_t blockSize;
+    double fill;
+    uint32_t usedBlocks;
+    string operation;
+    uint32_t count;
+    uint32_t failures;
+    double totalSeconds;
+    double p50Micros;
+    double p99Micros;
+    double meanMicros;
+    string firstError;  // First error logged by the timed calls
+} BenchResult;
+
+// Silences the operations' progress output while they are timed. Errors
+// still go to cerr.
+class QuietStreams {
+public:
+    QuietStreams() : sink("/dev/null"), savedOut(cout.rdbuf(sink.rdbuf())) {}
+    ~QuietStreams() {
+        cout.rdbuf(savedOut);
+    }
+
+private:
+    ofstream sink;
+    streambuf *savedOut;
+};
+
+// Collects what is logged to cerr while it is in scope
+class ErrorCapture {
+public:
+    ErrorCapture() : savedErr(cerr.rdbuf(errors.rdbuf())) {}
+    ~ErrorCapture() {
+        cerr.rdbuf(savedErr);
+    }
+    string firstLine() const {
+        string text = errors.str();
+        return text.substr(0, text.find('\n'));
+    }
+
+private:
+    ostringstream errors;
+    streambuf *savedErr;
+};
+
+static bool parseList(const string &text, vector<double> &values) {
+    values.clear();
+    stringstream stream(text);
+    string item;
+    while (getline(stream, item, ',')) {
+        char *end;
+        double value = strtod(item.c_str(), &end);
+        if (item.empty() || *end != '\0') {
+            return false;
+        }
+        values.push_back(value);
+    }
+    return !values.empty();
+}
+
+static double percentile(const vector<double> &sorted, double fraction) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t index = min(sorted.size() - 1, (size_t)(sorted.size() * fraction));
+    return sorted[index];
+}
+
+static uint32_t usedDataBlocks(const FileSystemSession &session) {
+    return session.superBlock.totalBlocks - session.superBlock.firstDataBlock - session.freeBlockCount;
+}
+
+// Upper bound on the data blocks the timed operations allocate: a block per
+// mkdir, the blocks of each written file, and for the two directories that
+// hold them the entries plus a hash index of up to 8 buckets per entry,
+// counted twice since a rebuild holds the old and the new index at once
+static uint32_t timedOperationBlocks(const BenchConfig &config, uint32_t blockSize) {
+    uint32_t fileBlocks = (config.fileSize + blockSize - 1) / blockSize;
+    uint64_t directoryBytes = (uint64_t)config.operations * (sizeof(DirectoryEntry) + 16 * sizeof(uint32_t));
+    uint32_t directoryBlocks = (uint32_t)((directoryBytes + blockSize - 1) / blockSize) + 1;
+    return config.operations * (fileBlocks + 1) + 2 * directoryBlocks;
+}
+
+// Fills the image to `fill` of its data blocks with files of fillFileBlocks
+// blocks, leaving room for the timed operations so that high fill levels
+// measure them rather than disk-full failures. With fragmentation, one-block
+// spacer directories are created between the files and removed afterwards,
+// leaving single-block holes.
+static void fillImage(FileSystemSession &session, const BenchConfig &config, double fill) {
+    uint32_t dataBlocks = session.superBlock.totalBlocks - session.superBlock.firstDataBlock;
+    uint32_t reserved = timedOperationBlocks(config, session.superBlock.blockSize);
+    uint32_t target = min((uint32_t)(dataBlocks * fill), dataBlocks > reserved ? dataBlocks - reserved : 0);
+    uint32_t spacersPerFile = (uint32_t)(config.fragmentation * config.fillFileBlocks + 0.5);
+    vector<uint8_t> data(config.fillFileBlocks * session.superBlock.blockSize, 'f');
+
+    QuietStreams quiet;
+    mkdir(session, "\\fill");
+    completeOperation(session);
+
+    uint32_t spacers = 0;
+    for (uint32_t file = 0; usedDataBlocks(session) + config.fillFileBlocks < target; file++) {
+        if (writeFile(session, "\\fill\\f" + to_string(file), data) != 0) {
+            break;
+        }
+        completeOperation(session);
+        for (uint32_t s = 0; s < spacersPerFile; s++, spacers++) {
+            mkdir(session, "\\fill\\s" + to_string(spacers));
+            completeOperation(session);
+        }
+    }
+    for (uint32_t s = 0; s < spacers; s++) {
+        rmdir(session, "\\fill\\s" + to_string(s));
+        completeOperation(session);
+    }
+    syncSession(session);
+}
+
+// Runs `operation` count times and records the latency of each call
+static BenchResult timeOperation(FileSystemSession &session, const string &name, uint32_t count,
+                                 const function<int(uint32_t)> &operation) {
+    BenchResult result = {};
+    result.operation = name;
+    result.count = count;
+
+    vector<double> latencies;
+    latencies.reserve(count);
+    QuietStreams quiet;
+    ErrorCapture errors;
+    for (uint32_t i = 0; i < count; i++) {
+        auto start = chrono::steady_clock::now();
+        int status = operation(i);
+        if (completeOperation(session) != 0) {
+            status = -1;
+        }
+        auto end = chrono::steady_clock::now();
+        if (status != 0) {
+            result.failures++;
+        }
+        latencies.push_back(chrono::duration<double, micro>(end - start).count());
+        result.totalSeconds += latencies.back() / 1e6;
+    }
+    result.firstError = errors.firstLine();
+
+    sort(latencies.begin(), latencies.end());
+    result.p50Micros = percentile(latencies, 0.50);
+    result.p99Micros = percentile(latencies, 0.99);
+    result.meanMicros = count > 0 ? result.totalSeconds * 1e6 / count : 0;
+    return result;
+}
+
+static int runBench(const BenchConfig &config, uint32_t blockSize, double fill, vector<BenchResult> &results) {
+    string image = config.workDir + "/bench_" + to_string(blockSize) + "_" + to_string((int)(fill * 100)) + ".dat";
+    {
+        QuietStreams quiet;
+        if (makeFileSystem(image, blockSize) != 0) {
+            return -1;
+        }
+    }
+
+    FileSystemSession session;
+    if (!openSession(session, image, config.backend)) {
+        return -1;
+    }
+    fillImage(session, config, fill);
+    uint32_t usedBlocks = usedDataBlocks(session);
+
+    int nullFd = open("/dev/null", O_WRONLY);
+    vector<uint8_t> data(config.fileSize, 'b');
+    {
+        QuietStreams quiet;
+        mkdir(session, "\\bench");
+        mkdir(session, "\\benchd");
+        completeOperation(session);
+    }
+
+    auto dirPath = [](uint32_t i) { return "\\benchd\\d" + to_string(i); };
+    auto filePath = [](uint32_t i) { return "\\bench\\f" + to_string(i); };
+    vector<BenchResult> runs;
+    runs.push_back(timeOperation(session, "mkdir", config.operations, [&](uint32_t i) { return mkdir(session, dirPath(i)); }));
+    runs.push_back(timeOperation(session, "write", config.operations, [&](uint32_t i) { return writeFile(session, filePath(i), data); }));
+    runs.push_back(timeOperation(session, "read", config.operations, [&](uint32_t i) { return catFile(session, filePath(i), nullFd); }));
+    runs.push_back(timeOperation(session, "dir", config.operations, [&](uint32_t) { dir(session, "\\bench"); return 0; }));
+    runs.push_back(timeOperation(session, "chmod", config.operations, [&](uint32_t i) { return chmod(session, filePath(i), true, i % 2 == 0); }));
+    runs.push_back(timeOperation(session, "rmdir", config.operations, [&](uint32_t i) { return rmdir(session, dirPath(i)); }));
+
+    close(nullFd);
+    closeSession(session);
+    unlink(image.c_str());
+
+    for (BenchResult &run : runs) {
+        run.blockSize = blockSize;
+        run.fill = fill;
+        run.usedBlocks = usedBlocks;
+        results.push_back(run);
+    }
+    return 0;
+}
+
+static string jsonString(const string &text) {
+    string quoted = "\"";
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            quoted += '\\';
+        }
+        quoted += (unsigned char)c < 0x20 ? ' ' : c;
+    }
+    return quoted + "\"";
+}
+
+static void printJson(const BenchConfig &config, const vector<BenchResult> &results) {
+    cout << "{\n";
+    cout << "  \"backend\": \"" << (config.backend == STORAGE_MMAP ? "mmap" : "pread") << "\",\n";
+    cout << "  \"operations\": " << config.operations << ",\n";
+    cout << "  \"fileSize\": " << config.fileSize << ",\n";
+    cout << "  \"fragmentation\": " << config.fragmentation << ",\n";
+    cout << "  \"results\": [\n";
+    for (size_t r = 0; r < results.size(); r++) {
+        const BenchResult &result = results[r];
+        cout << "    {\"blockSize\": " << result.blockSize
+             << ", \"fill\": " << result.fill
+             << ", \"usedBlocks\": " << result.usedBlocks
+             << ", \"operation\": \"" << result.operation << "\""
+             << ", \"count\": " << result.count
+             << ", \"failures\": " << result.failures
+             << ", \"opsPerSecond\": " << (result.totalSeconds > 0 ? result.count / result.totalSeconds : 0)
+             << ", \"p50Us\": " << result.p50Micros
+             << ", \"p99Us\": " << result.p99Micros
+             << ", \"meanUs\": " << result.meanMicros
+             << ", \"firstError\": " << jsonString(result.firstError) << "}"
+             << (r + 1 < results.size() ? "," : "") << "\n";
+    }
+    cout << "  ]\n";
+    cout << "}" << endl;
+}
+
+int main(int argc, char *argv[]) {
+    BenchConfig config;
+    config.blockSizes = {BLOCK_SIZE_512, BLOCK_SIZE_1024};
+    config.fillLevels = {0.0, 0.5, 0.9};
+    config.fragmentation = 0.0;
+    config.operations = 200;
+    config.fileSize = 4096;
+    config.fillFileBlocks = 8;
+    config.backend = STORAGE_MMAP;
+    config.workDir = ".";
+
+    for (int i = 1; i < argc; i++) {
+        string option = argv[i];
+        bool hasValue = i + 1 < argc;
+        vector<double> values;
+        if (option == "--block-sizes" && hasValue && parseList(argv[++i], values)) {
+            config.blockSizes.clear();
+            for (double value : values) {
+                if (value != BLOCK_SIZE_512 && value != BLOCK_SIZE_1024 && value != BLOCK_SIZE_2048 && value != BLOCK_SIZE_4096) {
+                    cerr << "Error: Block size must be one of 512, 1024, 2048 or 4096." << endl;
+                    return 1;
+                }
+                config.blockSizes.push_back((uint32_t)value);
+            }
+        } else if (option == "--fill" && hasValue && parseList(argv[++i], values)) {
+            config.fillLevels = values;
+        } else if (option == "--fragmentation" && hasValue) {
+            config.fragmentation = strtod(argv[++i], nullptr);
+        } else if (option == "--operations" && hasValue) {
+            config.operations = strtoul(argv[++i], nullptr, 10);
+        } else if (option == "--file-size" && hasValue) {
+            config.fileSize = strtoul(argv[++i], nullptr, 10);
+        } else if (option == "--backend" && hasValue) {
+            string name = argv[++i];
+            if (name != "mmap" && name != "pread") {
+                cerr << "Error: Backend must be either mmap or pread." << endl;
+                return 1;
+            }
+            config.backend = name == "mmap" ? STORAGE_MMAP : STORAGE_PREAD;
+        } else if (option == "--dir" && hasValue) {
+            config.workDir = argv[++i];
+        } else {
+            cerr << "Usage: " << argv[0] << " [--block-sizes 512,1024] [--fill 0,0.5,0.9] [--fragmentation f]"
+                 << " [--operations n] [--file-size bytes] [--backend mmap|pread] [--dir path]" << endl;
+            return 1;
+        }
+    }
+
+    vector<BenchResult> results;
+    for (uint32_t blockSize : config.blockSizes) {
+        for (double fill : config.fillLevels) {
+            if (runBench(config, blockSize, fill, results) != 0) {
+                cerr << "Benchmark failed for block size " << blockSize << " at fill " << fill << endl;
+                return 1;
+            }
+        }
+    }
+    printJson(config, results);
+    return 0;
+}
@@ -5,1042 +5,4288 @@
 #include <vector>
 #include <iomanip>
 #include <cstdio>
+#include <cstdlib>
+#include <ctime>
 #include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <functional>
+#include <thread>
+#include <unordered_set>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "fat12_file_system.h"
 
 using namespace std;
 
+LogLevel logLevel = LOG_LEVEL_WARN;
+
 // Function definitions
 
-void initializeSuperBlock(SuperBlock &superBlock, uint32_t blockSize) {
-    superBlock.totalBlocks = MAX_BLOCKS;
-    superBlock.freeBlocks = MAX_BLOCKS - 20; // 20 blocks used for metadata
+// Lays out the metadata region, the journal and the root directory for a
+// volume of totalBlocks blocks. Fails if the geometry is not supported.
+bool initializeSuperBlock(SuperBlock &superBlock, uint32_t blockSize, uint32_t totalBlocks) {
+    memset(&superBlock, 0, sizeof(SuperBlock));
+    superBlock.totalBlocks = totalBlocks;
     superBlock.blockSize = blockSize;
-    superBlock.rootDirectory = 19; // Setting root directory block correctly
-    superBlock.firstDataBlock = 20;
+    superBlock.magic = SUPERBLOCK_MAGIC;
+    superBlock.features = SUPERBLOCK_FEATURE_BLOCK_HIGH;
+    superBlock.fatEntrySize = totalBlocks <= FAT16_MAX_BLOCKS ? 2 : 4;
+    superBlock.bitmapOffset = (sizeof(SuperBlock) + 7) / 8 * 8;
+    superBlock.fatOffset = superBlock.bitmapOffset + bitmapSize(superBlock);
+    superBlock.metadataSize = superBlock.fatOffset + totalBlocks * superBlock.fatEntrySize;
+    superBlock.journalOffset = (superBlock.metadataSize + METADATA_SECTOR_SIZE - 1) / METADATA_SECTOR_SIZE * METADATA_SECTOR_SIZE;
+    superBlock.rootDirectory = (superBlock.journalOffset + JOURNAL_SIZE + blockSize - 1) / blockSize;
+    superBlock.firstDataBlock = superBlock.rootDirectory + 1;
+    superBlock.freeBlocks = totalBlocks > superBlock.firstDataBlock ? totalBlocks - superBlock.firstDataBlock : 0;
+    return validSuperBlock(superBlock, (uint64_t)totalBlocks * blockSize);
+}
+
+// Checks that the geometry is one this code can use on an image of imageSize bytes
+bool validSuperBlock(const SuperBlock &superBlock, uint64_t imageSize) {
+    uint32_t blockSize = superBlock.blockSize;
+    uint64_t volumeSize = (uint64_t)superBlock.totalBlocks * blockSize;
+    return (blockSize == BLOCK_SIZE_512 || blockSize == BLOCK_SIZE_1024 || blockSize == BLOCK_SIZE_2048 || blockSize == BLOCK_SIZE_4096) &&
+           superBlock.totalBlocks <= MAX_TOTAL_BLOCKS && volumeSize <= MAX_IMAGE_SIZE && volumeSize <= imageSize &&
+           (superBlock.fatEntrySize == 2 || superBlock.fatEntrySize == 4) &&
+           (superBlock.fatEntrySize == 4 || superBlock.totalBlocks <= FAT16_MAX_BLOCKS) &&
+           ((superBlock.features & SUPERBLOCK_FEATURE_BLOCK_HIGH) || superBlock.totalBlocks <= FAT16_MAX_BLOCKS) &&
+           superBlock.bitmapOffset >= superBlockSize(superBlock) &&
+           superBlock.fatOffset >= superBlock.bitmapOffset + bitmapSize(superBlock) &&
+           superBlock.metadataSize == superBlock.fatOffset + (uint64_t)superBlock.totalBlocks * superBlock.fatEntrySize &&
+           superBlock.journalOffset >= superBlock.metadataSize &&
+           (uint64_t)superBlock.rootDirectory * blockSize >= superBlock.journalOffset &&
+           superBlock.rootDirectory < superBlock.firstDataBlock && superBlock.firstDataBlock < superBlock.totalBlocks;
+}
+
+// Bytes of the superblock on disk
+size_t superBlockSize(const SuperBlock &superBlock) {
+    return superBlock.magic == SUPERBLOCK_MAGIC ? sizeof(SuperBlock) : LEGACY_SUPERBLOCK_SIZE;
+}
+
+// Bytes of the free block bitmap, whole 64-bit words so it can be scanned a word at a time
+uint32_t bitmapSize(const SuperBlock &superBlock) {
+    return (superBlock.totalBlocks + 63) / 64 * 8;
+}
+
+// Fills in the fixed geometry of images without the geometry fields
+static void loadLegacyGeometry(SuperBlock &superBlock) {
+    if (superBlock.magic == SUPERBLOCK_MAGIC) {
+        return;
+    }
+    superBlock.magic = 0;
+    superBlock.features = 0;
+    superBlock.fatEntrySize = 2;
+    superBlock.bitmapOffset = LEGACY_BITMAP_OFFSET;
+    superBlock.fatOffset = LEGACY_FAT_OFFSET;
+    superBlock.metadataSize = LEGACY_METADATA_SIZE;
+    superBlock.journalOffset = (LEGACY_METADATA_SIZE + METADATA_SECTOR_SIZE - 1) / METADATA_SECTOR_SIZE * METADATA_SECTOR_SIZE;
 }
 
-void initializeRootDirectory(ofstream &file, SuperBlock &superBlock) {
-    DirectoryEntry emptyEntries[16] = {};
-    file.seekp(superBlock.rootDirectory * superBlock.blockSize, ios::beg);
-    file.write(reinterpret_cast<char*>(emptyEntries), sizeof(emptyEntries));
-    cerr << "Root directory initialized. Size: " << sizeof(emptyEntries) << " bytes" << endl;
+// Fills a zeroed root directory block with the directory header
+void initializeRootDirectory(uint8_t *block, const SuperBlock &superBlock) {
+    DirectoryHeader header = {};
+    header.mark = DIRECTORY_HEADER_MARK;
+    header.tailBlock = superBlock.rootDirectory;
+    header.tailUsed = 1;
+    memcpy(block, &header, sizeof(header));
+    LOG_DEBUG("Root directory initialized. Size: " << superBlock.blockSize << " bytes");
 }
 
 void writeSuperBlock(ofstream &file, SuperBlock &superBlock) {
     file.seekp(0, ios::beg);
-    file.write(reinterpret_cast<char*>(&superBlock), sizeof(SuperBlock));
-    cerr << "Superblock written. Size: " << sizeof(SuperBlock) << " bytes" << endl;
+    file.write(reinterpret_cast<char*>(&superBlock), superBlockSize(superBlock));
+    LOG_DEBUG("Superblock written. Size: " << superBlockSize(superBlock) << " bytes");
 }
 
-void writeSuperBlock(fstream &file, SuperBlock &superBlock) {
-    file.seekp(0, ios::beg);
-    file.write(reinterpret_cast<char*>(&superBlock), sizeof(SuperBlock));
-    cerr << "Superblock written. Size: " << sizeof(SuperBlock) << " bytes" << endl;
+void writeSuperBlock(ImageStorage &storage, SuperBlock &superBlock) {
+    storageWrite(storage, 0, &superBlock, superBlockSize(superBlock));
+    LOG_DEBUG("Superblock written. Size: " << superBlockSize(superBlock) << " bytes");
 }
 
 void readSuperBlock(ifstream &file, SuperBlock &superBlock) {
+    memset(&superBlock, 0, sizeof(SuperBlock));
     file.seekg(0, ios::beg);
     file.read(reinterpret_cast<char*>(&superBlock), sizeof(SuperBlock));
+    loadLegacyGeometry(superBlock);
 }
 
-void readSuperBlock(fstream &file, SuperBlock &superBlock) {
-    file.seekg(0, ios::beg);
-    file.read(reinterpret_cast<char*>(&superBlock), sizeof(SuperBlock));
+void readSuperBlock(ImageStorage &storage, SuperBlock &superBlock) {
+    memset(&superBlock, 0, sizeof(SuperBlock));
+    storageRead(storage, 0, &superBlock, sizeof(SuperBlock));
+    loadLegacyGeometry(superBlock);
 }
 
-void initializeFreeBlocks(uint8_t *free_blocks) {
-    memset(free_blocks, 0xFF, MAX_BLOCKS / 8); // Mark all blocks as free
-    for (int i = 0; i < 20; i++) {
-        free_blocks[i / 8] &= ~(1 << (i % 8)); // Mark first 20 blocks as used
+// Marks the data blocks free and everything else, including the padding
+// after the last block, used
+void initializeFreeBlocks(uint8_t *free_blocks, const SuperBlock &superBlock) {
+    memset(free_blocks, 0, bitmapSize(superBlock));
+    // Bit by bit up to a byte boundary at both ends, whole bytes in between
+    uint32_t block = superBlock.firstDataBlock;
+    uint32_t end = superBlock.totalBlocks;
+    for (; block < end && block % 8 != 0; block++) {
+        free_blocks[block / 8] |= 1 << (block % 8);
+    }
+    if (block < end / 8 * 8) {
+        memset(free_blocks + block / 8, 0xFF, end / 8 - block / 8);
+        block = end / 8 * 8;
+    }
+    for (; block < end; block++) {
+        free_blocks[block / 8] |= 1 << (block % 8);
     }
 }
 
-void writeFreeBlocks(ofstream &file, uint8_t *free_blocks) {
-    file.seekp(sizeof(SuperBlock), ios::beg);
-    file.write(reinterpret_cast<char*>(free_blocks), MAX_BLOCKS / 8);
-    cerr << "Free blocks written. Size: " << MAX_BLOCKS / 8 << " bytes" << endl;
+void writeFreeBlocks(ofstream &file, const uint8_t *free_blocks, const SuperBlock &superBlock) {
+    file.seekp(superBlock.bitmapOffset, ios::beg);
+    file.write(reinterpret_cast<const char*>(free_blocks), bitmapSize(superBlock));
+    LOG_DEBUG("Free blocks written. Size: " << bitmapSize(superBlock) << " bytes");
 }
 
-void writeFreeBlocks(fstream &file, uint8_t *free_blocks) {
-    file.seekp(sizeof(SuperBlock), ios::beg);
-    file.write(reinterpret_cast<char*>(free_blocks), MAX_BLOCKS / 8);
-    cerr << "Free blocks written. Size: " << MAX_BLOCKS / 8 << " bytes" << endl;
+void writeFreeBlocks(ImageStorage &storage, const uint8_t *free_blocks, const SuperBlock &superBlock) {
+    storageWrite(storage, superBlock.bitmapOffset, free_blocks, bitmapSize(superBlock));
+    LOG_DEBUG("Free blocks written. Size: " << bitmapSize(superBlock) << " bytes");
 }
 
-void readFreeBlocks(ifstream &file, uint8_t *free_blocks) {
-    file.seekg(sizeof(SuperBlock), ios::beg);
-    file.read(reinterpret_cast<char*>(free_blocks), MAX_BLOCKS / 8);
+void readFreeBlocks(ifstream &file, uint8_t *free_blocks, const SuperBlock &superBlock) {
+    file.seekg(superBlock.bitmapOffset, ios::beg);
+    file.read(reinterpret_cast<char*>(free_blocks), bitmapSize(superBlock));
 }
 
-void readFreeBlocks(fstream &file, uint8_t *free_blocks) {
-    file.seekg(sizeof(SuperBlock), ios::beg);
-    file.read(reinterpret_cast<char*>(free_blocks), MAX_BLOCKS / 8);
+void readFreeBlocks(ImageStorage &storage, uint8_t *free_blocks, const SuperBlock &superBlock) {
+    storageRead(storage, superBlock.bitmapOffset, free_blocks, bitmapSize(superBlock));
 }
 
-void initializeFAT12(FAT12Entry *fat) {
-    for (int i = 0; i < MAX_BLOCKS; i++) {
-        fat[i] = FAT_FREE;
-    }
+void initializeFAT12(uint8_t *fat, const SuperBlock &superBlock) {
+    memset(fat, 0, (size_t)superBlock.totalBlocks * superBlock.fatEntrySize); // FAT_FREE at any width
 }
 
-void writeFAT12(ofstream &file, FAT12Entry *fat) {
-    size_t fatSize = MAX_BLOCKS * sizeof(FAT12Entry); // Calculate size of the FAT12 table
-    file.seekp(sizeof(SuperBlock) + MAX_BLOCKS / 8, ios::beg);
-    file.write(reinterpret_cast<char*>(fat), fatSize);
+void writeFAT12(ofstream &file, const uint8_t *fat, const SuperBlock &superBlock) {
+    size_t fatSize = (size_t)superBlock.totalBlocks * superBlock.fatEntrySize; // Calculate size of the FAT12 table
+    file.seekp(superBlock.fatOffset, ios::beg);
+    file.write(reinterpret_cast<const char*>(fat), fatSize);
 }
 
-void writeFAT12(fstream &file, FAT12Entry *fat) {
-    size_t fatSize = MAX_BLOCKS * sizeof(FAT12Entry); // Calculate size of the FAT12 table
-    file.seekp(sizeof(SuperBlock) + MAX_BLOCKS / 8, ios::beg);
-    file.write(reinterpret_cast<char*>(fat), fatSize);
+void writeFAT12(ImageStorage &storage, const uint8_t *fat, const SuperBlock &superBlock) {
+    size_t fatSize = (size_t)superBlock.totalBlocks * superBlock.fatEntrySize; // Calculate size of the FAT12 table
+    storageWrite(storage, superBlock.fatOffset, fat, fatSize);
 }
 
-uint32_t readFAT12Entry(const FAT12Entry *fat, uint32_t currentBlock) {
-    return fat[currentBlock];
+// First block of a file or directory. first_block_high sits in bytes older
+// images left reserved, so it is only read on images with
+// SUPERBLOCK_FEATURE_BLOCK_HIGH; the others are small enough for 16 bits.
+uint32_t entryFirstBlock(const SuperBlock &superBlock, const DirectoryEntry &entry) {
+    uint32_t high = (superBlock.features & SUPERBLOCK_FEATURE_BLOCK_HIGH) ? entry.first_block_high : 0;
+    return entry.first_block_number | high << 16;
 }
 
-int chmod(const string &fileSystemFile, const string &path, bool readPermission, bool writePermission) {
-    fstream file(fileSystemFile, ios::binary | ios::in | ios::out);
-    if (!file.is_open()) {
-        cerr << "Failed to open file system file: " << fileSystemFile << endl;
-        return -1;
+// Stores block in entry, leaving the reserved bytes of older images untouched
+void setEntryFirstBlock(const SuperBlock &superBlock, DirectoryEntry &entry, uint32_t block) {
+    entry.first_block_number = block & 0xFFFF;
+    if (superBlock.features & SUPERBLOCK_FEATURE_BLOCK_HIGH) {
+        entry.first_block_high = block >> 16;
     }
+}
 
-    SuperBlock superBlock;
-    readSuperBlock(file, superBlock);
+// Name of a directory entry as used in paths, without the space/NUL padding
+// of the 8.3 fields (e.g. "notes.txt", "docs")
+string directoryEntryName(const DirectoryEntry &entry) {
+    size_t nameLength = strnlen(entry.filename, sizeof(entry.filename));
+    while (nameLength > 0 && entry.filename[nameLength - 1] == ' ') {
+        nameLength--;
+    }
+    size_t extensionLength = strnlen(entry.extension, sizeof(entry.extension));
+    while (extensionLength > 0 && entry.extension[extensionLength - 1] == ' ') {
+        extensionLength--;
+    }
 
-    uint32_t currentBlock = superBlock.rootDirectory;
+    string name(entry.filename, nameLength);
+    if (extensionLength > 0) {
+        name += "." + string(entry.extension, extensionLength);
+    }
+    return name;
+}
 
-    vector<string> dirs;
-    size_t start = 0, end;
+// Compares a path component against an entry name as directoryEntryName()
+// would build it, without materializing the name
+bool directoryEntryNameEquals(const DirectoryEntry &entry, string_view name) {
+    size_t nameLength = strnlen(entry.filename, sizeof(entry.filename));
+    while (nameLength > 0 && entry.filename[nameLength - 1] == ' ') {
+        nameLength--;
+    }
+    size_t extensionLength = strnlen(entry.extension, sizeof(entry.extension));
+    while (extensionLength > 0 && entry.extension[extensionLength - 1] == ' ') {
+        extensionLength--;
+    }
 
-    if (path[0] == '\\') {
-        start = 1;
+    if (name.substr(0, nameLength) != string_view(entry.filename, nameLength)) {
+        return false;
+    }
+    if (extensionLength == 0) {
+        return name.size() == nameLength;
     }
-    while ((end = path.find('\\', start)) != string::npos) {
-        string dir = path.substr(start, end - start);
-        if (!dir.empty()) {
-            dirs.push_back(dir);
+    return name.size() == nameLength + 1 + extensionLength && name[nameLength] == '.' &&
+           name.substr(nameLength + 1) == string_view(entry.extension, extensionLength);
+}
+
+// Image offset of a block, by the shift openSession() derived from the block size
+static inline uint64_t blockOffset(const FileSystemSession &session, uint32_t block) {
+    return (uint64_t)block << session.blockShift;
+}
+
+// Follows a FAT chain far enough to cover byteCount bytes and merges
+// physically consecutive blocks into runs. Stops at FAT_END, at a free or
+// out-of-range entry, or after totalBlocks steps so a looping chain ends.
+void collectChainRuns(const FileSystemSession &session, uint32_t firstBlock, uint64_t byteCount, vector<BlockRun> &runs) {
+    uint32_t blockSize = session.superBlock.blockSize;
+    uint64_t blocksNeeded = max<uint64_t>(1, (byteCount + blockSize - 1) / blockSize);
+    uint32_t block = firstBlock;
+
+    runs.clear();
+    for (uint64_t steps = 0; steps < blocksNeeded && steps < session.superBlock.totalBlocks; steps++) {
+        if (block < session.superBlock.firstDataBlock || block >= session.superBlock.totalBlocks) {
+            break;
+        }
+        if (!runs.empty() && runs.back().start + runs.back().length == block) {
+            runs.back().length++;
+        } else {
+            runs.push_back({block, 1});
+        }
+        uint32_t next = readFAT12Entry(session, block);
+        if (next == FAT_END || next == FAT_FREE) {
+            break;
         }
-        start = end + 1;
+        block = next;
     }
-    if (start < path.size()) {
-        dirs.push_back(path.substr(start));
+}
+
+// Appends the runs holding file blocks first..last of an indexed chain,
+// trimmed to that range. Stops early if the chain is shorter.
+static void sliceChainIndex(const ChainIndexNode &node, uint64_t first, uint64_t last, vector<BlockRun> &runs) {
+    size_t r = upper_bound(node.runStarts.begin(), node.runStarts.end(), first) - node.runStarts.begin();
+    for (r = r > 0 ? r - 1 : 0; r < node.runs.size() && first <= last; r++) {
+        uint64_t skip = first - node.runStarts[r];
+        if (skip >= node.runs[r].length) {
+            break;
+        }
+        uint32_t length = min<uint64_t>(node.runs[r].length - skip, last - first + 1);
+        runs.push_back({node.runs[r].start + (uint32_t)skip, length});
+        first += length;
     }
+}
 
-    for (size_t i = 0; i < dirs.size(); ++i) {
-        bool found = false;
-        vector<DirectoryEntry> entries = readDirectoryEntries(file, currentBlock);
-        for (auto &entry : entries) {
-            string entryName(entry.filename, strnlen(entry.filename, sizeof(entry.filename)));
-            if (!string(entry.extension).empty()) {
-                entryName += "." + string(entry.extension, strnlen(entry.extension, sizeof(entry.extension)));
-            }
-            if (entryName == dirs[i]) {
-                if (i == dirs.size() - 1) {
-                    entry.attributes.read_permission = readPermission;
-                    entry.attributes.write_permission = writePermission;
-
-                    file.seekp(currentBlock * superBlock.blockSize, ios::beg);
-                    file.write(reinterpret_cast<char*>(entries.data()), entries.size() * sizeof(DirectoryEntry));
-                    file.flush();
-
-                    file.close();
-                    cout << "Permissions changed successfully." << endl;
-                    return 0;
-                }
-                if (entry.attributes.is_directory) {
-                    currentBlock = entry.first_block_number;
-                    found = true;
-                    break;
-                } else {
-                    cerr << "Not a directory: " << dirs[i] << endl;
-                    return -1;
-                }
-            }
+// Runs of the blocks holding bytes [offset, offset + length) of a file, the
+// first starting at the block that holds offset. The chain index is looked
+// up in session.chainIndexes and built from the FAT on a miss; as in
+// lookupDentry(), the FAT walk runs without cacheMutex held.
+static void chainRunsInRange(FileSystemSession &session, const DirectoryEntry &fileEntry, uint64_t offset, uint64_t length,
+                             vector<BlockRun> &runs) {
+    ChainIndexCache &cache = session.chainIndexes;
+    uint32_t firstBlock = entryFirstBlock(session.superBlock, fileEntry);
+    uint64_t first = offset >> session.blockShift;
+    uint64_t last = (offset + max<uint64_t>(length, 1) - 1) >> session.blockShift;
+    runs.clear();
+    {
+        lock_guard<mutex> guard(session.cacheMutex);
+        auto it = cache.nodes.find(firstBlock);
+        if (it != cache.nodes.end() && it->second->fileSize == fileEntry.file_size) {
+            cache.lru.splice(cache.lru.begin(), cache.lru, it->second);
+            cache.hits++;
+            sliceChainIndex(*it->second, first, last, runs);
+            return;
         }
-        if (!found) {
-            cerr << "Directory or file not found: " << dirs[i] << endl;
-            return -1;
+        cache.misses++;
+    }
+
+    ChainIndexNode node = {firstBlock, fileEntry.file_size, {}, {}};
+    collectChainRuns(session, firstBlock, fileEntry.file_size, node.runs);
+    node.runStarts.reserve(node.runs.size());
+    uint32_t fileBlock = 0;
+    for (const BlockRun &run : node.runs) {
+        node.runStarts.push_back(fileBlock);
+        fileBlock += run.length;
+    }
+    sliceChainIndex(node, first, last, runs);
+
+    lock_guard<mutex> guard(session.cacheMutex);
+    if (cache.capacity == 0) {
+        return;
+    }
+    auto it = cache.nodes.find(firstBlock);
+    if (it != cache.nodes.end()) {
+        cache.lru.erase(it->second);
+        cache.nodes.erase(it);
+    } else if (cache.nodes.size() >= cache.capacity) {
+        cache.nodes.erase(cache.lru.back().firstBlock);
+        cache.lru.pop_back();
+    }
+    cache.lru.push_front(std::move(node));
+    cache.nodes[firstBlock] = cache.lru.begin();
+}
+
+// Moves a cached chain index from oldSize to newSize after blocks were
+// linked to the end of its chain. A file without a cached index gets one
+// built from the FAT by its next lookup.
+static void extendChainIndex(FileSystemSession &session, uint32_t firstBlock, uint32_t oldSize, uint32_t newSize,
+                             const vector<uint32_t> &blocks) {
+    ChainIndexCache &cache = session.chainIndexes;
+    lock_guard<mutex> guard(session.cacheMutex);
+    auto it = cache.nodes.find(firstBlock);
+    if (it == cache.nodes.end() || it->second->fileSize != oldSize || it->second->runs.empty()) {
+        return;
+    }
+    ChainIndexNode &node = *it->second;
+    for (uint32_t block : blocks) {
+        BlockRun &last = node.runs.back();
+        if (last.start + last.length == block) {
+            last.length++;
+        } else {
+            node.runStarts.push_back(node.runStarts.back() + last.length);
+            node.runs.push_back({block, 1});
         }
     }
+    node.fileSize = newSize;
+}
 
-    file.close();
-    cerr << "Failed to change permissions." << endl;
-    return -1;
+// Drops the chain index of the chain starting at firstBlock
+static void eraseChainIndex(FileSystemSession &session, uint32_t firstBlock) {
+    ChainIndexCache &cache = session.chainIndexes;
+    lock_guard<mutex> guard(session.cacheMutex);
+    auto it = cache.nodes.find(firstBlock);
+    if (it != cache.nodes.end()) {
+        cache.lru.erase(it->second);
+        cache.nodes.erase(it);
+        cache.invalidations++;
+    }
 }
 
-int addpw(const string &fileSystemFile, const string &path, const string &password) {
-    fstream file(fileSystemFile, ios::binary | ios::in | ios::out);
-    if (!file.is_open()) {
-        cerr << "Failed to open file system file: " << fileSystemFile << endl;
+int chmod(FileSystemSession &session, const string &path, bool readPermission, bool writePermission) {
+    unique_lock<shared_mutex> lock(session.metadataLock);
+    ResolvedPath resolved;
+    if (resolvePath(session, path, resolved) != 0) {
+        return -1;
+    }
+    if (resolved.name.empty()) {
+        LOG_ERROR("Failed to change permissions.");
+        return -1;
+    }
+    if (!resolved.found) {
+        LOG_ERROR("Directory or file not found: " << resolved.name);
         return -1;
     }
 
-    SuperBlock superBlock;
-    readSuperBlock(file, superBlock);
-
-    uint32_t currentBlock = superBlock.rootDirectory;
+    DirectoryEntry &entry = resolved.entry;
+    entry.attributes.read_permission = readPermission;
+    entry.attributes.write_permission = writePermission;
+    writeDirectoryEntry(session, resolved.slot, entry);
 
-    vector<string> dirs;
-    size_t start = 0, end;
+    cout << "Permissions changed successfully." << endl;
+    return 0;
+}
 
-    if (path[0] == '\\') {
-        start = 1;
+int addpw(FileSystemSession &session, const string &path, const string &password) {
+    unique_lock<shared_mutex> lock(session.metadataLock);
+    ResolvedPath resolved;
+    if (resolvePath(session, path, resolved) != 0) {
+        return -1;
     }
-    while ((end = path.find('\\', start)) != string::npos) {
-        string dir = path.substr(start, end - start);
-        if (!dir.empty()) {
-            dirs.push_back(dir);
-        }
-        start = end + 1;
+    if (resolved.name.empty()) {
+        LOG_ERROR("Failed to add/change password.");
+        return -1;
     }
-    if (start < path.size()) {
-        dirs.push_back(path.substr(start));
+    if (!resolved.found) {
+        LOG_ERROR("Directory or file not found: " << resolved.name);
+        return -1;
     }
 
-    for (size_t i = 0; i < dirs.size(); ++i) {
-        bool found = false;
-        vector<DirectoryEntry> entries = readDirectoryEntries(file, currentBlock);
-        for (auto &entry : entries) {
-            string entryName(entry.filename, strnlen(entry.filename, sizeof(entry.filename)));
-            if (!string(entry.extension).empty()) {
-                entryName += "." + string(entry.extension, strnlen(entry.extension, sizeof(entry.extension)));
-            }
-            if (entryName == dirs[i]) {
-                if (i == dirs.size() - 1) {
-                    strncpy(entry.password, password.c_str(), sizeof(entry.password) - 1);
-                    entry.password[sizeof(entry.password) - 1] = '\0'; // Ensure null termination
-
-                    file.seekp(currentBlock * superBlock.blockSize, ios::beg);
-                    file.write(reinterpret_cast<char*>(entries.data()), entries.size() * sizeof(DirectoryEntry));
-                    file.flush();
-
-                    file.close();
-                    cout << "Password added/changed successfully." << endl;
-                    return 0;
-                }
-                if (entry.attributes.is_directory) {
-                    currentBlock = entry.first_block_number;
-                    found = true;
-                    break;
-                } else {
-                    cerr << "Not a directory: " << dirs[i] << endl;
-                    return -1;
-                }
-            }
-        }
-        if (!found) {
-            cerr << "Directory or file not found: " << dirs[i] << endl;
-            return -1;
-        }
-    }
+    DirectoryEntry &entry = resolved.entry;
+    strncpy(entry.password, password.c_str(), sizeof(entry.password) - 1);
+    entry.password[sizeof(entry.password) - 1] = '\0'; // Ensure null termination
+    writeDirectoryEntry(session, resolved.slot, entry);
 
-    file.close();
-    cerr << "Failed to add/change password." << endl;
-    return -1;
+    cout << "Password added/changed successfully." << endl;
+    return 0;
 }
 
-void readFAT12(ifstream &file, FAT12Entry *fat) {
-    size_t fatSize = MAX_BLOCKS * sizeof(FAT12Entry);
-    file.seekg(sizeof(SuperBlock) + MAX_BLOCKS / 8, ios::beg);
+void readFAT12(ifstream &file, uint8_t *fat, const SuperBlock &superBlock) {
+    size_t fatSize = (size_t)superBlock.totalBlocks * superBlock.fatEntrySize;
+    file.seekg(superBlock.fatOffset, ios::beg);
     file.read(reinterpret_cast<char*>(fat), fatSize);
 }
 
-void readFAT12(fstream &file, FAT12Entry *fat) {
-    size_t fatSize = MAX_BLOCKS * sizeof(FAT12Entry);
-    file.seekg(sizeof(SuperBlock) + MAX_BLOCKS / 8, ios::beg);
-    file.read(reinterpret_cast<char*>(fat), fatSize);
+void readFAT12(ImageStorage &storage, uint8_t *fat, const SuperBlock &superBlock) {
+    size_t fatSize = (size_t)superBlock.totalBlocks * superBlock.fatEntrySize;
+    storageRead(storage, superBlock.fatOffset, fat, fatSize);
 }
 
-int findFreeBlock(FAT12Entry *fat) {
-    for (int i = 20; i < MAX_BLOCKS; i++) {
-        if (fat[i] == FAT_FREE) {
-            return i;
+// Opens the image with the requested backend. mmap falls back to pread/pwrite
+// when the image cannot be mapped.
+bool openStorage(ImageStorage &storage, const string &fileSystemFile, StorageBackend backend) {
+    storage.fd = open(fileSystemFile.c_str(), O_RDWR);
+    storage.backend = STORAGE_PREAD;
+    storage.mapping = nullptr;
+    storage.size = 0;
+    storage.io.reads = 0;
+    storage.io.writes = 0;
+    storage.io.bytesRead = 0;
+    storage.io.bytesWritten = 0;
+    storage.io.seeks = 0;
+    storage.io.syncs = 0;
+    storage.io.nextOffset = 0;
+    if (storage.fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(storage.fd, &st) != 0) {
+        close(storage.fd);
+        storage.fd = -1;
+        return false;
+    }
+    storage.size = st.st_size;
+
+    if (backend == STORAGE_MMAP && storage.size > 0) {
+        void *mapping = mmap(nullptr, storage.size, PROT_READ | PROT_WRITE, MAP_SHARED, storage.fd, 0);
+        if (mapping != MAP_FAILED) {
+            storage.mapping = static_cast<uint8_t*>(mapping);
+            storage.backend = STORAGE_MMAP;
+        } else {
+            LOG_WARN("mmap failed (" << strerror(errno) << "), using pread/pwrite");
         }
     }
-    return -1;
+    return true;
 }
 
-// Adding a directory entry
-void addDirectoryEntry(fstream &file, DirectoryEntry &entry, uint32_t block) {
-    vector<DirectoryEntry> entries = readDirectoryEntries(file, block);
-    bool entryAdded = false;
+static inline void countAccess(ImageStorage &storage, uint64_t offset, size_t length) {
+    if (storage.io.nextOffset.exchange(offset + length) != offset) {
+        storage.io.seeks++;
+    }
+}
 
-    // Find the first empty slot to add the new entry
-    for (auto &dirEntry : entries) {
-        if (dirEntry.filename[0] == 0) { // Empty slot found
-            dirEntry = entry;
-            entryAdded = true;
-            break;
+bool storageRead(ImageStorage &storage, uint64_t offset, void *buffer, size_t length) {
+    countAccess(storage, offset, length);
+    storage.io.reads++;
+    storage.io.bytesRead += length;
+    if (storage.mapping) {
+        if (offset + length > storage.size) {
+            return false;
         }
+        memcpy(buffer, storage.mapping + offset, length);
+        return true;
     }
 
-    if (!entryAdded) {
-        cerr << "No empty slot found in block: " << block << endl;
-        return;
+    uint8_t *out = static_cast<uint8_t*>(buffer);
+    while (length > 0) {
+        ssize_t n = pread(storage.fd, out, length, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        out += n;
+        offset += n;
+        length -= n;
     }
-
-    // Write the updated entries back to the block
-    file.seekp(block * 512, ios::beg);
-    file.write(reinterpret_cast<char*>(entries.data()), entries.size() * sizeof(DirectoryEntry));
-    file.flush(); // Ensure the data is written to the file
-    cerr << "Added directory entry for: " << entry.filename << " in block: " << block << endl;
+    return true;
 }
 
-// Reading directory entries from a specific block
-vector<DirectoryEntry> readDirectoryEntries(fstream &file, uint32_t block) {
-    vector<DirectoryEntry> entries(16); // Assuming a block can hold 16 directory entries
-    file.seekg(block * 512, ios::beg);
-    file.read(reinterpret_cast<char*>(entries.data()), entries.size() * sizeof(DirectoryEntry));
+bool storageWrite(ImageStorage &storage, uint64_t offset, const void *buffer, size_t length) {
+    countAccess(storage, offset, length);
+    storage.io.writes++;
+    storage.io.bytesWritten += length;
+    if (storage.mapping) {
+        if (offset + length > storage.size) {
+            return false;
+        }
+        memmove(storage.mapping + offset, buffer, length);
+        return true;
+    }
 
-    return entries;
+    const uint8_t *in = static_cast<const uint8_t*>(buffer);
+    while (length > 0) {
+        ssize_t n = pwrite(storage.fd, in, length, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        in += n;
+        offset += n;
+        length -= n;
+    }
+    return true;
 }
 
-bool validateFileSystem(const string &fileSystemFile, const string &newDirName) {
-    fstream file(fileSystemFile, ios::binary | ios::in | ios::out);
-    if (!file.is_open()) {
-        cerr << "Failed to open file system file: " << fileSystemFile << endl;
-        return false;
+// Direct pointer into the image for in-place access, or null without mmap
+uint8_t *storagePointer(ImageStorage &storage, uint64_t offset, size_t length) {
+    if (!storage.mapping || offset + length > storage.size) {
+        return nullptr;
     }
+    return storage.mapping + offset;
+}
 
-    SuperBlock superBlock;
-    readSuperBlock(file, superBlock);
+// Durability point: msync the mapping or fdatasync the descriptor
+int storageSync(ImageStorage &storage) {
+    storage.io.syncs++;
+    if (storage.mapping) {
+        return msync(storage.mapping, storage.size, MS_SYNC);
+    }
+    return fdatasync(storage.fd);
+}
 
-    uint32_t rootBlock = superBlock.rootDirectory;
-    vector<DirectoryEntry> rootEntries = readDirectoryEntries(file, rootBlock);
+void closeStorage(ImageStorage &storage) {
+    if (storage.mapping) {
+        munmap(storage.mapping, storage.size);
+        storage.mapping = nullptr;
+    }
+    if (storage.fd >= 0) {
+        close(storage.fd);
+        storage.fd = -1;
+    }
+}
 
-    bool dirFound = false;
-    cout << "Root directory entries:\n";
-    cout << "------------------------\n";
-    for (const auto &entry : rootEntries) {
-        if (entry.filename[0] != 0) { // Only print non-empty entries
-            string entryName(entry.filename, strnlen(entry.filename, sizeof(entry.filename)));
-            string entryType = entry.attributes.is_directory ? "Directory" : "File";
-            cout << "Name: " << entryName << ", Type: " << entryType << ", First Block: " << entry.first_block_number << endl;
-
-            if (entryName == newDirName && entry.attributes.is_directory) {
-                dirFound = true;
-                uint32_t dirBlock = entry.first_block_number;
-
-                // Check that the directory block is initialized
-                vector<DirectoryEntry> dirEntries = readDirectoryEntries(file, dirBlock);
-                for (const auto &dirEntry : dirEntries) {
-                    if (dirEntry.filename[0] != 0) {
-                        cerr << "Error: Directory block is not empty" << endl;
-                        return false;
-                    }
-                }
+static void replayJournal(FileSystemSession &session);
+static const DirectoryOps *selectDirectoryOps(uint32_t blockSize);
 
-                cout << "Directory '" << newDirName << "' is correctly created in block " << dirBlock << endl;
-                break;
-            }
-        } else {
-            cout << "Empty directory entry" << endl;
-        }
+// Opens the image and makes SuperBlock, free block bitmap and FAT resident.
+// They live in a private copy with either backend, so a change reaches the
+// image only when its sector is written back.
+bool openSession(FileSystemSession &session, const string &fileSystemFile, StorageBackend backend, size_t cacheBytes) {
+    if (!openStorage(session.storage, fileSystemFile, backend)) {
+        LOG_ERROR("Failed to open file system file: " << fileSystemFile);
+        return false;
     }
 
-    if (!dirFound) {
-        cerr << "Error: Directory '" << newDirName << "' not found in root directory" << endl;
+    ImageStorage &storage = session.storage;
+    session.imagePath = fileSystemFile;
+    session.metadataDirty = false;
+    session.metadataBytesWritten = 0;
+    session.metadataWrites = 0;
+    session.operationCount = 0;
+    session.fileReads = 0;
+    session.dataReadCalls = 0;
+    session.dataBytesRead = 0;
+    session.dentries.capacity = DENTRY_CACHE_CAPACITY;
+    session.dentries.lru.clear();
+    session.dentries.nodes.clear();
+    session.dentries.hits = 0;
+    session.dentries.misses = 0;
+    session.dentries.invalidations = 0;
+    session.chainIndexes.capacity = CHAIN_INDEX_CACHE_CAPACITY;
+    session.chainIndexes.lru.clear();
+    session.chainIndexes.nodes.clear();
+    session.chainIndexes.hits = 0;
+    session.chainIndexes.misses = 0;
+    session.chainIndexes.invalidations = 0;
+    session.blockCache.budget = 0;
+    session.blockCache.lru.clear();
+    session.blockCache.blocks.clear();
+    session.blockCache.hits = 0;
+    session.blockCache.misses = 0;
+    session.blockCache.evictions = 0;
+    session.blockCache.writebacks = 0;
+    session.journal.pending.clear();
+    session.journal.pendingBytes = 0;
+    session.journal.pendingFrees.clear();
+    session.journal.sequence = 0;
+    session.journal.groupOperations = 0;
+    session.journal.commits = 0;
+    session.journal.bytesLogged = 0;
+    session.journal.earlyCommits = 0;
+    session.journal.replays = 0;
+    session.fatFlushes = 0;
+    session.bitmapFlushes = 0;
+    session.directoryBlocksScanned = 0;
+    session.workerThreads = 0;
+    session.operationStats.clear();
+    session.currentOperation.clear();
+
+    SuperBlock &superBlock = session.superBlock;
+    bool loaded = storage.size >= sizeof(SuperBlock);
+    if (loaded) {
+        readSuperBlock(storage, superBlock);
+        loaded = validSuperBlock(superBlock, storage.size);
+    }
+    // Before the superblock had a magic, directory blocks were placed at
+    // block * 512 whatever the block size, so only 512-byte images share
+    // today's layout
+    if (loaded && superBlock.magic == 0 && superBlock.blockSize != BLOCK_SIZE_512) {
+        LOG_ERROR("Unsupported image: " << fileSystemFile << " predates the superblock magic and uses " << superBlock.blockSize
+                  << "-byte blocks; its directories are not at their block offsets. Recreate it with makeFileSystem.");
+        closeStorage(storage);
         return false;
     }
+    if (loaded) {
+        session.blockShift = __builtin_ctz(superBlock.blockSize);
+        replayJournal(session);
+        readSuperBlock(storage, superBlock);
+        loaded = validSuperBlock(superBlock, storage.size);
+    }
+    if (loaded) {
+        // Replay restores the superblock, so the block size is taken again
+        session.blockShift = __builtin_ctz(superBlock.blockSize);
+        session.directoryOps = selectDirectoryOps(superBlock.blockSize);
+        session.metadataBuffer.resize(superBlock.metadataSize);
+        uint8_t *metadata = session.metadataBuffer.data();
+        loaded = storageRead(storage, 0, metadata, superBlock.metadataSize);
+        session.free_blocks = metadata + superBlock.bitmapOffset;
+        session.fat = metadata + superBlock.fatOffset;
+        uint64_t sectorWords = (superBlock.metadataSize + METADATA_SECTOR_SIZE * 64 - 1) / (METADATA_SECTOR_SIZE * 64);
+        session.dirtySectors.assign(sectorWords, 0);
+    }
 
-    file.close();
+    if (!loaded) {
+        LOG_ERROR("Failed to read file system metadata: " << fileSystemFile);
+        closeStorage(storage);
+        return false;
+    }
+    // The cache budget follows the backend in use, which is pread after a
+    // failed mmap even when mmap was asked for
+    session.blockCache.budget = storage.backend == STORAGE_PREAD ? cacheBytes : 0;
+    initializeAllocator(session);
     return true;
 }
 
-// Updated mkdir function
-int mkdir(const string &fileSystemFile, const string &path) {
-
-    fstream file(fileSystemFile, ios::binary | ios::in | ios::out);
-    if (!file.is_open()) {
-        cerr << "Failed to open file system file: " << fileSystemFile << endl;
-        return -1;
-    }
-
-    SuperBlock superBlock;
-    readSuperBlock(file, superBlock);
-
-    uint8_t free_blocks[MAX_BLOCKS / 8];
-    readFreeBlocks(file, free_blocks);
-
-    FAT12Entry fat[MAX_BLOCKS];
-    readFAT12(file, fat);
-
-    uint32_t currentBlock = superBlock.rootDirectory;
+// Bytes of records the journal region can hold
+static uint64_t journalCapacity(const FileSystemSession &session) {
+    uint64_t end = blockOffset(session, session.superBlock.rootDirectory);
+    uint64_t start = session.superBlock.journalOffset + sizeof(JournalHeader);
+    return end > start ? end - start : 0;
+}
 
-    vector<string> dirs;
-    size_t start = 0, end;
+// Longest range one journalRange() call may add, so that it fits an empty
+// group; 0 when the image has no room for a journal
+static uint64_t journalRangeLimit(const FileSystemSession &session) {
+    uint64_t capacity = journalCapacity(session);
+    return capacity > sizeof(JournalRecord) ? capacity - sizeof(JournalRecord) : 0;
+}
 
-    if (path[0] == '\\') {
-        start = 1;
+// Adds an image range to the open journal group, extending the previous
+// range when the two touch. pendingBytes grows by the bytes and record
+// header the range can add to the encoded group, so the group size is
+// known without encoding it; overlaps with older ranges are counted twice.
+// When the range could push the group past the journal, the group is
+// committed first, even in the middle of an operation, so the caller must
+// add a range before changing its bytes.
+static void journalRange(FileSystemSession &session, uint64_t offset, uint64_t length) {
+    JournalState &journal = session.journal;
+    vector<JournalRange> &pending = journal.pending;
+    if (!pending.empty() && journalRangeLimit(session) > 0 &&
+        journal.pendingBytes + sizeof(JournalRecord) + length > journalCapacity(session)) {
+        journal.earlyCommits++;
+        commitJournal(session);
     }
-    while ((end = path.find('\\', start)) != string::npos) {
-        string dir = path.substr(start, end - start);
-        if (!dir.empty()) {
-            dirs.push_back(dir);
+    if (!pending.empty()) {
+        JournalRange &last = pending.back();
+        if (offset >= last.offset && offset <= last.offset + last.length) {
+            uint64_t end = max(last.length, offset + length - last.offset);
+            journal.pendingBytes += end - last.length;
+            last.length = end;
+            return;
         }
-        start = end + 1;
-    }
-    if (start < path.size()) {
-        dirs.push_back(path.substr(start));
     }
+    pending.push_back({offset, length});
+    journal.pendingBytes += sizeof(JournalRecord) + length;
+}
 
-    for (size_t i = 0; i < dirs.size(); ++i) {
-        bool found = false;
-        vector<DirectoryEntry> entries = readDirectoryEntries(file, currentBlock);
-        for (auto &entry : entries) {
-            string entryName(entry.filename, strnlen(entry.filename, sizeof(entry.filename)));
-            if (entryName == dirs[i]) {
-                if (i == dirs.size() - 1) {
-                    cerr << "Directory already exists: " << dirs[i] << endl;
-                    return -1;
-                }
-                if (entry.attributes.is_directory) {
-                    currentBlock = entry.first_block_number;
-                    found = true;
-                    break;
-                } else {
-                    cerr << "Not a directory: " << dirs[i] << endl;
-                    return -1;
-                }
-            }
-        }
-        if (!found) {
-            if (i != dirs.size() - 1) {
-                cerr << "Parent directory not found: " << dirs[i] << endl;
-                return -1;
-            }
+// Records that [offset, offset + length) of the metadata region is about to
+// change; see journalRange() for why it comes first
+void markMetadataDirty(FileSystemSession &session, uint64_t offset, size_t length) {
+    if (length == 0) {
+        return;
+    }
+    journalRange(session, offset, length);
+    uint64_t first = offset / METADATA_SECTOR_SIZE;
+    uint64_t last = (offset + length - 1) / METADATA_SECTOR_SIZE;
+    for (uint64_t sector = first; sector <= last; sector++) {
+        session.dirtySectors[sector / 64] |= 1ULL << (sector % 64);
+    }
+    session.metadataDirty = true;
+}
 
-            int freeBlock = findFreeBlock(fat);
-            if (freeBlock == -1) {
-                cerr << "No free blocks available" << endl;
-                return -1;
-            }
+// FAT entry of block as FAT_FREE, FAT_END or the next block, whatever the
+// entry width on disk
+uint32_t readFAT12Entry(const FileSystemSession &session, uint32_t block) {
+    if (session.superBlock.fatEntrySize == 4) {
+        uint32_t value;
+        memcpy(&value, session.fat + (size_t)block * 4, sizeof(value));
+        return value;
+    }
+    uint16_t value;
+    memcpy(&value, session.fat + (size_t)block * 2, sizeof(value));
+    return value == FAT16_END ? FAT_END : value;
+}
 
-            fat[freeBlock] = FAT_END;
-            free_blocks[freeBlock / 8] &= ~(1 << (freeBlock % 8));
-            writeFAT12(file, fat);
-            writeFreeBlocks(file, free_blocks);
-
-            DirectoryEntry newDir;
-            memset(&newDir, 0, sizeof(DirectoryEntry));
-            strncpy(newDir.filename, dirs[i].c_str(), sizeof(newDir.filename) - 1);
-            newDir.filename[sizeof(newDir.filename) - 1] = '\0'; // Ensure null termination
-            newDir.attributes.is_directory = 1;
-            newDir.attributes.read_permission = 1;
-            newDir.attributes.write_permission = 1;
-            newDir.creation_date = {1, 1, 40}; // Date: 01/01/1980
-            newDir.last_modification_date = newDir.creation_date;
-            newDir.first_block_number = freeBlock;
-            newDir.file_size = 0;
-
-            // Write the new directory entry
-            addDirectoryEntry(file, newDir, currentBlock);
-        
-            // Initialize new directory block with empty entries
-            DirectoryEntry emptyEntries[16] = {};
-            file.seekp(freeBlock * superBlock.blockSize, ios::beg);
-            file.write(reinterpret_cast<char*>(emptyEntries), sizeof(emptyEntries));
-            cout << "Initialized new directory block: " << freeBlock << endl;
-
-            currentBlock = freeBlock;
-        }
-    }
-
-    file.close();
-    cout << "Directory created successfully." << endl;
+// Stores a FAT entry without recording the change; callers mark the range
+static void storeFATEntry(FileSystemSession &session, uint32_t block, FAT12Entry value) {
+    uint8_t *entry = session.fat + (size_t)block * session.superBlock.fatEntrySize;
+    if (session.superBlock.fatEntrySize == 4) {
+        memcpy(entry, &value, sizeof(value));
+    } else {
+        uint16_t narrow = value == FAT_END ? FAT16_END : value;
+        memcpy(entry, &narrow, sizeof(narrow));
+    }
+}
 
-    return 0;
+void setFATEntry(FileSystemSession &session, uint32_t block, FAT12Entry value) {
+    uint32_t entrySize = session.superBlock.fatEntrySize;
+    markMetadataDirty(session, session.superBlock.fatOffset + (uint64_t)block * entrySize, entrySize);
+    storeFATEntry(session, block, value);
 }
 
-// Updated dir function
-void dir(const string &fileSystemFile, const string &path) {
-    fstream file(fileSystemFile, ios::binary | ios::in | ios::out);
-    if (!file.is_open()) {
-        cerr << "Failed to open file system file: " << fileSystemFile << endl;
-        return;
+void setBlockFree(FileSystemSession &session, uint32_t block, bool isFree) {
+    markMetadataDirty(session, session.superBlock.bitmapOffset + block / 8, 1);
+    if (isFree) {
+        session.free_blocks[block / 8] |= (1 << (block % 8));
+    } else {
+        session.free_blocks[block / 8] &= ~(1 << (block % 8));
     }
+}
 
-    SuperBlock superBlock;
-    readSuperBlock(file, superBlock);
-
-    FAT12Entry fat[MAX_BLOCKS];
-    readFAT12(file, fat);
+static void updateFreeBlockCount(FileSystemSession &session) {
+    if (session.superBlock.freeBlocks != session.freeBlockCount) {
+        markMetadataDirty(session, 0, sizeof(SuperBlock));
+        session.superBlock.freeBlocks = session.freeBlockCount;
+    }
+}
 
-    uint32_t currentBlock = superBlock.rootDirectory; // Start at the correct root directory block
+static bool writeBackBlock(FileSystemSession &session, CachedBlock &cached) {
+    if (!cached.dirty) {
+        return true;
+    }
+    if (!storageWrite(session.storage, blockOffset(session, cached.block), cached.data.data(), cached.data.size())) {
+        return false;
+    }
+    cached.dirty = false;
+    session.blockCache.writebacks++;
+    return true;
+}
 
-    if (path != "\\") {
-        vector<string> dirs;
-        size_t start = 0, end;
-        if (path[0] == '\\') {
-            start = 1;
-        }
-        while ((end = path.find('\\', start)) != string::npos) {
-            string dir = path.substr(start, end - start);
-            if (!dir.empty()) {
-                dirs.push_back(dir);
-            }
-            start = end + 1;
+// Makes room for one more block by evicting from the cold end of the LRU.
+// Blocks with uncommitted journaled changes stay until the group commits,
+// so the cache may run over its budget in the meantime.
+static bool evictBlocks(FileSystemSession &session) {
+    BlockCache &cache = session.blockCache;
+    uint32_t blockSize = session.superBlock.blockSize;
+    auto victim = cache.lru.end();
+    while (victim != cache.lru.begin() && (cache.blocks.size() + 1) * blockSize > cache.budget) {
+        --victim;
+        if (victim->journaled) {
+            continue;
         }
-        if (start < path.size()) {
-            dirs.push_back(path.substr(start));
-        }
-
-        for (const auto &dir : dirs) {
-            bool found = false;
-            vector<DirectoryEntry> entries = readDirectoryEntries(file, currentBlock);
-            for (const auto &entry : entries) {
-                string entryName(entry.filename, strnlen(entry.filename, sizeof(entry.filename)));
-                if (entryName == dir && entry.attributes.is_directory) {
-                    currentBlock = entry.first_block_number;
-                    found = true;
-                    break;
-                }
-            }
-            if (!found) {
-                cerr << "Directory not found: " << dir << endl;
-                return;
-            }
+        if (!writeBackBlock(session, *victim)) {
+            return false;
         }
+        cache.blocks.erase(victim->block);
+        victim = cache.lru.erase(victim);
+        cache.evictions++;
     }
+    return true;
+}
 
-    vector<DirectoryEntry> entries = readDirectoryEntries(file, currentBlock);
-
-    cout << "Permissions  Size       Creation Date       Modification Date    Password  Name\n";
-    cout << "--------------------------------------------------------------------------------\n";
-
-    for (const auto &entry : entries) {
-        if (entry.filename[0] != 0) { // Only print non-empty entries
-            string entryName(entry.filename, strnlen(entry.filename, sizeof(entry.filename)));
-            string entryExtension(entry.extension, strnlen(entry.extension, sizeof(entry.extension)));
-            string fullName = entryName + (entryExtension.empty() ? "" : "." + entryExtension);
-
-            string permissions = "";
-            permissions += (entry.attributes.read_permission ? "r" : "-");
-            permissions += (entry.attributes.write_permission ? "w" : "-");
-            permissions += (entry.attributes.is_directory ? "d" : "-");
-
-            cout << permissions << "      "
-                 << entry.file_size << "       "
-                 << entry.creation_date.year + 1980 << "-"
-                 << (int)entry.creation_date.month << "-"
-                 << (int)entry.creation_date.day << "       "
-                 << entry.last_modification_date.year + 1980 << "-"
-                 << (int)entry.last_modification_date.month << "-"
-                 << (int)entry.last_modification_date.day << "       "
-                 << (entry.attributes.is_protected ? "Yes" : "No") << "        "
-                 << fullName << "\n";
-        }
+// Cached copy of block, read from the image on a miss unless the caller is
+// about to overwrite all of it
+static CachedBlock *cacheBlock(FileSystemSession &session, uint32_t block, bool load) {
+    BlockCache &cache = session.blockCache;
+    auto it = cache.blocks.find(block);
+    if (it != cache.blocks.end()) {
+        cache.lru.splice(cache.lru.begin(), cache.lru, it->second);
+        cache.hits++;
+        return &*it->second;
     }
 
-    file.close();
+    cache.misses++;
+    if (!evictBlocks(session)) {
+        return nullptr;
+    }
+    CachedBlock cached = {block, false, false, vector<uint8_t>(session.superBlock.blockSize)};
+    if (load && !storageRead(session.storage, blockOffset(session, block), cached.data.data(), cached.data.size())) {
+        return nullptr;
+    }
+    cache.lru.push_front(std::move(cached));
+    cache.blocks[block] = cache.lru.begin();
+    return &cache.lru.front();
 }
 
-// Remove directory function
-int rmdir(const string &fileSystemFile, const string &path) {
-    fstream file(fileSystemFile, ios::binary | ios::in | ios::out);
-    if (!file.is_open()) {
-        cerr << "Failed to open file system file: " << fileSystemFile << endl;
-        return -1;
+// Reads length bytes at offset. Cached blocks are copied from memory; a
+// read inside one block loads it into the cache, while uncached stretches
+// of a longer read are fetched from the image in a single call each, with
+// cacheMutex released so that concurrent readers are not serialized.
+// With the cache disabled only the blocks staged by journaledWrite() are
+// served from memory.
+bool blockCacheRead(FileSystemSession &session, uint64_t offset, void *buffer, size_t length) {
+    BlockCache &cache = session.blockCache;
+    uint32_t blockSize = session.superBlock.blockSize;
+    bool enabled = cache.budget >= blockSize;
+    // Blocks are only staged with the cache disabled under an exclusive
+    // metadataLock, so readers may test for them without cacheMutex
+    if ((!enabled && cache.blocks.empty()) || length == 0) {
+        return storageRead(session.storage, offset, buffer, length);
     }
 
-    SuperBlock superBlock;
-    readSuperBlock(file, superBlock);
-    cout << "SuperBlock read successfully" << endl;
-
-    uint8_t free_blocks[MAX_BLOCKS / 8];
-    readFreeBlocks(file, free_blocks);
-    cout << "Free blocks read successfully" << endl;
-
-    FAT12Entry fat[MAX_BLOCKS];
-    readFAT12(file, fat);
-    cout << "FAT12 table read successfully" << endl;
-
-    uint32_t currentBlock = superBlock.rootDirectory;
-    cout << "Reading directory entries from block: " << currentBlock << endl;
-    
-    vector<string> dirs;
-    size_t start = 0, end;
-
-    if (path[0] == '\\') {
-        start = 1;
-    }
-    while ((end = path.find('\\', start)) != string::npos) {
-        string dir = path.substr(start, end - start);
-        if (!dir.empty()) {
-            dirs.push_back(dir);
-        }
-        start = end + 1;
-    }
-    if (start < path.size()) {
-        dirs.push_back(path.substr(start));
-    }
-
-    for (size_t i = 0; i < dirs.size(); ++i) {
-        bool found = false;
-        vector<DirectoryEntry> entries = readDirectoryEntries(file, currentBlock);
-        for (auto &entry : entries) {
-            string entryName(entry.filename, strnlen(entry.filename, sizeof(entry.filename)));
-            if (entryName == dirs[i]) {
-                cout << "Found directory: " << entryName << " in block: " << currentBlock << endl;
-                if (i == dirs.size() - 1) {
-                    if (!entry.attributes.is_directory) {
-                        cerr << "Not a directory: " << dirs[i] << endl;
-                        return -1;
-                    }
-
-                    // Check if directory is empty
-                    vector<DirectoryEntry> subEntries = readDirectoryEntries(file, entry.first_block_number);
-                    bool isEmpty = true;
-                    for (const auto &subEntry : subEntries) {
-                        if (subEntry.filename[0] != 0) {
-                            isEmpty = false;
-                            break;
-                        }
-                    }
-                    if (!isEmpty) {
-                        cerr << "Directory not empty: " << dirs[i] << endl;
-                        return -1;
-                    }
-
-                    cout << "Before clearing directory entry:" << endl;
-                    for (const auto &e : entries) {
-                        if (e.filename[0] != 0) {
-                            cout << "Name: " << string(e.filename, strnlen(e.filename, sizeof(e.filename))) << endl;
-                        }
-                    }
-
-                    // Clear the directory entry
-                    for (auto &e : entries) {
-                        string eName(e.filename, strnlen(e.filename, sizeof(e.filename)));
-                        if (eName == dirs[i]) {
-                            memset(&e, 0, sizeof(DirectoryEntry));
-                            break;
-                        }
-                    }
-
-                    file.seekp(currentBlock * superBlock.blockSize, ios::beg);
-                    file.write(reinterpret_cast<char*>(entries.data()), entries.size() * sizeof(DirectoryEntry));
-                    file.flush(); // Ensure data is written to the file
-                    cout << "Cleared directory entry for: " << dirs[i] << " in block: " << currentBlock << endl;
-
-                    // Mark the directory block as free
-                    int dirBlock = entry.first_block_number;
-                    fat[dirBlock] = FAT_FREE;
-                    free_blocks[dirBlock / 8] |= (1 << (dirBlock % 8));
-                    writeFAT12(file, fat);
-                    writeFreeBlocks(file, free_blocks);
-                    cout << "Marked block " << dirBlock << " as free" << endl;
-
-                    // Initialize the cleared directory block to empty entries
-                    DirectoryEntry emptyEntries[16] = {};
-                    file.seekp(dirBlock * superBlock.blockSize, ios::beg);
-                    file.write(reinterpret_cast<char*>(emptyEntries), sizeof(emptyEntries));
-                    cout << "Cleared directory block: " << dirBlock << endl;
-
-                    cout << "After clearing directory entry:" << endl;
-                    entries = readDirectoryEntries(file, currentBlock);
-                    bool cleared = true;
-                    for (const auto &e : entries) {
-                        if (e.filename[0] != 0) {
-                            cout << "Name: " << string(e.filename, strnlen(e.filename, sizeof(e.filename))) << endl;
-                            if (string(e.filename, strnlen(e.filename, sizeof(e.filename))) == dirs[i]) {
-                                cleared = false;
-                            }
-                        }
-                    }
-
-                    file.close();
-
-                    if (!cleared) {
-                        cerr << "Error: Directory entry not cleared for: " << dirs[i] << endl;
-                        return -1;
-                    }
-
-                    cout << "Directory removed successfully." << endl;
-                    return 0;
-                } else {
-                    currentBlock = entry.first_block_number;
-                    found = true;
-                    break;
-                }
+    unique_lock<mutex> guard(session.cacheMutex);
+    uint32_t shift = session.blockShift;
+    uint8_t *out = static_cast<uint8_t*>(buffer);
+    uint64_t end = offset + length;
+    bool singleBlock = enabled && offset >> shift == (end - 1) >> shift;
+    uint64_t position = offset;
+    while (position < end) {
+        uint32_t block = position >> shift;
+        uint64_t blockEnd = min<uint64_t>(end, ((uint64_t)block + 1) << shift);
+        if (singleBlock || cache.blocks.count(block)) {
+            CachedBlock *cached = cacheBlock(session, block, true);
+            if (!cached) {
+                return false;
             }
+            memcpy(out + (position - offset), cached->data.data() + (position & (blockSize - 1)), blockEnd - position);
+            position = blockEnd;
+            continue;
         }
-        if (!found) {
-            cerr << "Directory not found: " << dirs[i] << endl;
-            return -1;
+
+        while (blockEnd < end && !cache.blocks.count(blockEnd >> shift)) {
+            blockEnd = min<uint64_t>(end, blockEnd + blockSize);
+        }
+        guard.unlock();
+        if (!storageRead(session.storage, position, out + (position - offset), blockEnd - position)) {
+            return false;
         }
+        guard.lock();
+        position = blockEnd;
     }
-
-    return 0;
+    return true;
 }
 
-int dumpe2fs(const string &fileSystemFile) {
-    fstream file(fileSystemFile, ios::binary | ios::in);
-    if (!file.is_open()) {
-        cerr << "Failed to open file system file: " << fileSystemFile << endl;
-        return -1;
+// Writes length bytes at offset. Writes inside one block and writes to
+// cached blocks only dirty the cached copy; uncached stretches of a longer
+// write go straight to the image, with cacheMutex released as in
+// blockCacheRead() so that threads writing different blocks (the workers
+// of importTree()) do not wait on each other's I/O. With the cache
+// disabled only the blocks staged by journaledWrite() are written in memory.
+bool blockCacheWrite(FileSystemSession &session, uint64_t offset, const void *buffer, size_t length) {
+    BlockCache &cache = session.blockCache;
+    uint32_t blockSize = session.superBlock.blockSize;
+    bool enabled = cache.budget >= blockSize;
+    if ((!enabled && cache.blocks.empty()) || length == 0) {
+        return storageWrite(session.storage, offset, buffer, length);
     }
 
-    SuperBlock superBlock;
-    readSuperBlock(file, superBlock);
-    cout << "Superblock information:" << endl;
-    cout << "Total blocks: " << superBlock.totalBlocks << endl;
-    cout << "Free blocks: " << superBlock.freeBlocks << endl;
-    cout << "Block size: " << superBlock.blockSize << " bytes" << endl;
-    cout << "Root directory block: " << superBlock.rootDirectory << endl;
-    cout << "First data block: " << superBlock.firstDataBlock << endl;
+    unique_lock<mutex> guard(session.cacheMutex);
+    uint32_t shift = session.blockShift;
+    const uint8_t *in = static_cast<const uint8_t*>(buffer);
+    uint64_t end = offset + length;
+    bool singleBlock = enabled && offset >> shift == (end - 1) >> shift;
+    uint64_t position = offset;
+    while (position < end) {
+        uint32_t block = position >> shift;
+        uint64_t blockStart = (uint64_t)block << shift;
+        uint64_t blockEnd = min<uint64_t>(end, blockStart + blockSize);
+        if (singleBlock || cache.blocks.count(block)) {
+            bool wholeBlock = position == blockStart && blockEnd == blockStart + blockSize;
+            CachedBlock *cached = cacheBlock(session, block, !wholeBlock);
+            if (!cached) {
+                return false;
+            }
+            memcpy(cached->data.data() + (position - blockStart), in + (position - offset), blockEnd - position);
+            cached->dirty = true;
+            position = blockEnd;
+            continue;
+        }
 
-    uint8_t free_blocks[MAX_BLOCKS / 8];
-    readFreeBlocks(file, free_blocks);
-    cout << "Free blocks bitmap (hex):" << endl;
-    for (int i = 0; i < MAX_BLOCKS / 8; i++) {
-        if (i % 16 == 0) {
-            cout << endl;
+        while (blockEnd < end && !cache.blocks.count(blockEnd >> shift)) {
+            blockEnd = min<uint64_t>(end, blockEnd + blockSize);
         }
-        cout << hex << setw(2) << setfill('0') << (int)free_blocks[i];
+        guard.unlock();
+        if (!storageWrite(session.storage, position, in + (position - offset), blockEnd - position)) {
+            return false;
+        }
+        guard.lock();
+        position = blockEnd;
     }
-    cout << endl;
+    return true;
+}
 
-    FAT12Entry fat[MAX_BLOCKS];
-    readFAT12(file, fat);
-    cout << "FAT12 table (non-empty blocks):" << endl;
-    for (int i = 0; i < MAX_BLOCKS; i++) {
-        if (fat[i] != FAT_FREE) {
-            cout << "Block " << i << ": " << hex << fat[i] << endl;
+// Writes dirty cached blocks back to the image in block order. Blocks with
+// uncommitted journaled changes are only included when journaled is set.
+static int writeBackDirtyBlocks(FileSystemSession &session, bool journaled) {
+    vector<CachedBlock*> dirty;
+    for (CachedBlock &cached : session.blockCache.lru) {
+        if (cached.dirty && (journaled || !cached.journaled)) {
+            dirty.push_back(&cached);
         }
     }
-
-    cout << "Root directory entries:" << endl;
-    vector<DirectoryEntry> rootEntries = readDirectoryEntries(file, superBlock.rootDirectory);
-    for (const auto &entry : rootEntries) {
-        if (entry.filename[0] != 0) {
-            cout << "Name: " << string(entry.filename, strnlen(entry.filename, sizeof(entry.filename))) << endl;
-            cout << "First block: " << entry.first_block_number << endl;
-            cout << "Is directory: " << (entry.attributes.is_directory ? "Yes" : "No") << endl;
+    sort(dirty.begin(), dirty.end(), [](const CachedBlock *a, const CachedBlock *b) { return a->block < b->block; });
+    for (CachedBlock *cached : dirty) {
+        if (!writeBackBlock(session, *cached)) {
+            return -1;
         }
+        cached->journaled = false;
     }
-
-    file.close();
     return 0;
 }
 
-int readFile(const string &fileSystemFile, const string &path) {
-    cout << "Reading file: " << path << endl;
-    cout << "From file system: " << fileSystemFile << endl;
+// Writes every dirty cached block back to the image
+int flushBlockCache(FileSystemSession &session) {
+    return writeBackDirtyBlocks(session, true);
+}
 
-    fstream file(fileSystemFile, ios::binary | ios::in);
-    if (!file.is_open()) {
-        cerr << "Failed to open file system file: " << fileSystemFile << endl;
-        return -1;
+// True if any block in [start, start + length) has a dirty cached copy
+static bool blockCacheHasDirty(const FileSystemSession &session, uint32_t start, uint32_t length) {
+    const BlockCache &cache = session.blockCache;
+    for (uint32_t block = start; block < start + length && !cache.blocks.empty(); block++) {
+        auto it = cache.blocks.find(block);
+        if (it != cache.blocks.end() && it->second->dirty) {
+            return true;
+        }
     }
+    return false;
+}
 
-    SuperBlock superBlock;
-    readSuperBlock(file, superBlock);
+// Writes every run of consecutive dirty sectors with one write, a copy into
+// the mapping with mmap. The caller syncs the image.
+static int flushMetadata(FileSystemSession &session) {
+    ImageStorage &storage = session.storage;
+    uint8_t *metadata = session.metadataBuffer.data();
+    const SuperBlock &superBlock = session.superBlock;
+    uint64_t sectorCount = (superBlock.metadataSize + METADATA_SECTOR_SIZE - 1) / METADATA_SECTOR_SIZE;
 
-    uint32_t currentBlock = superBlock.rootDirectory;
+    if (session.dirtySectors[0] & 1) {
+        memcpy(metadata, &superBlock, superBlockSize(superBlock));
+    }
+
+    uint64_t sector = 0;
+    while (sector < sectorCount) {
+        if (!(session.dirtySectors[sector / 64] & (1ULL << (sector % 64)))) {
+            sector++;
+            continue;
+        }
+        uint64_t runEnd = sector;
+        while (runEnd < sectorCount && (session.dirtySectors[runEnd / 64] & (1ULL << (runEnd % 64)))) {
+            runEnd++;
+        }
+
+        uint64_t offset = sector * METADATA_SECTOR_SIZE;
+        uint64_t length = min<uint64_t>(runEnd * METADATA_SECTOR_SIZE, superBlock.metadataSize) - offset;
+        if (!storageWrite(storage, offset, metadata + offset, length)) {
+            return -1;
+        }
+        session.metadataBytesWritten += length;
+        session.metadataWrites++;
+        if (offset + length > superBlock.fatOffset) {
+            session.fatFlushes++;
+        }
+        if (offset < superBlock.fatOffset && offset + length > superBlock.bitmapOffset) {
+            session.bitmapFlushes++;
+        }
+        sector = runEnd;
+    }
+
+    fill(session.dirtySectors.begin(), session.dirtySectors.end(), 0);
+    session.metadataDirty = false;
+    return 0;
+}
+
+// Writes a metadata change outside the metadata region (directory blocks,
+// headers and index buckets) and adds it to the open journal group. The
+// change is staged in the block cache whatever the backend and budget, and
+// its blocks stay pinned there until the group commits, so nothing reaches
+// the image (or a shared mapping) ahead of the commit record.
+// Writes longer than a group can hold are logged in pieces.
+bool journaledWrite(FileSystemSession &session, uint64_t offset, const void *buffer, size_t length) {
+    uint64_t limit = journalRangeLimit(session);
+    const uint8_t *in = static_cast<const uint8_t*>(buffer);
+    while (limit > 0 && length > limit) {
+        if (!journaledWrite(session, offset, in, limit)) {
+            return false;
+        }
+        offset += limit;
+        in += limit;
+        length -= limit;
+    }
+    if (length == 0) {
+        return true;
+    }
+    journalRange(session, offset, length);
+
+    uint32_t blockSize = session.superBlock.blockSize;
+    uint32_t shift = session.blockShift;
+    uint64_t end = offset + length;
+    lock_guard<mutex> guard(session.cacheMutex);
+    for (uint64_t position = offset; position < end;) {
+        uint32_t block = position >> shift;
+        uint64_t blockStart = (uint64_t)block << shift;
+        uint64_t blockEnd = min<uint64_t>(end, blockStart + blockSize);
+        bool wholeBlock = position == blockStart && blockEnd == blockStart + blockSize;
+        CachedBlock *cached = cacheBlock(session, block, !wholeBlock);
+        if (!cached) {
+            return false;
+        }
+        memcpy(cached->data.data() + (position - blockStart), in + (position - offset), blockEnd - position);
+        cached->dirty = true;
+        cached->journaled = true;
+        position = blockEnd;
+    }
+    return true;
+}
+
+static uint32_t journalChecksum(uint32_t sequence, const uint8_t *records, size_t length) {
+    uint32_t hash = 2166136261u;
+    uint32_t fields[2] = {sequence, (uint32_t)length};
+    const uint8_t *bytes = reinterpret_cast<const uint8_t*>(fields);
+    for (size_t i = 0; i < sizeof(fields); i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ records[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static void appendJournalRecord(vector<uint8_t> &records, uint64_t offset, size_t length, uint16_t flags, const uint8_t *data) {
+    JournalRecord record = {(uint32_t)offset, (uint16_t)length, flags};
+    const uint8_t *bytes = reinterpret_cast<const uint8_t*>(&record);
+    records.insert(records.end(), bytes, bytes + sizeof(record));
+    if (!(flags & JOURNAL_RECORD_ZERO)) {
+        records.insert(records.end(), data, data + length);
+    }
+}
+
+// Zero runs at least this long are logged as zero-fill records
+#define JOURNAL_ZERO_RUN 16
+
+// Appends the open group's records, built from the current contents of its
+// ranges, to records
+static void encodeJournalGroup(FileSystemSession &session, vector<uint8_t> &records) {
+    vector<JournalRange> ranges = session.journal.pending;
+    sort(ranges.begin(), ranges.end(), [](const JournalRange &a, const JournalRange &b) { return a.offset < b.offset; });
+    size_t merged = 0;
+    for (size_t r = 1; r < ranges.size(); r++) {
+        JournalRange &last = ranges[merged];
+        if (ranges[r].offset <= last.offset + last.length) {
+            last.length = max(last.length, ranges[r].offset + ranges[r].length - last.offset);
+        } else {
+            ranges[++merged] = ranges[r];
+        }
+    }
+    ranges.resize(ranges.empty() ? 0 : merged + 1);
+
+    // The superblock is kept outside the metadata region until it is flushed
+    uint8_t *metadata = session.free_blocks - session.superBlock.bitmapOffset;
+    memcpy(metadata, &session.superBlock, superBlockSize(session.superBlock));
+
+    const uint16_t maxRecord = 0xFFFF;
+    vector<uint8_t> image;
+    for (const JournalRange &range : ranges) {
+        image.resize(range.length);
+        if (range.offset + range.length <= session.superBlock.metadataSize) {
+            memcpy(image.data(), metadata + range.offset, range.length);
+        } else {
+            blockCacheRead(session, range.offset, image.data(), range.length);
+        }
+
+        auto zeroRun = [&](size_t from) {
+            size_t end = from;
+            while (end < image.size() && image[end] == 0 && end - from < maxRecord) {
+                end++;
+            }
+            return end - from;
+        };
+        size_t position = 0;
+        while (position < image.size()) {
+            size_t zeros = zeroRun(position);
+            if (zeros >= JOURNAL_ZERO_RUN) {
+                appendJournalRecord(records, range.offset + position, zeros, JOURNAL_RECORD_ZERO, nullptr);
+                position += zeros;
+                continue;
+            }
+            size_t end = position;
+            while (end < image.size() && end - position < maxRecord && !(image[end] == 0 && zeroRun(end) >= JOURNAL_ZERO_RUN)) {
+                end++;
+            }
+            appendJournalRecord(records, range.offset + position, end - position, 0, image.data() + position);
+            position = end;
+        }
+    }
+}
+
+// Sets the bitmap bits of the blocks freed in the open group, as part of that
+// group. Until it commits they read as used, so no new data is written to a
+// block that the last committed metadata may still point at.
+static void applyPendingFrees(FileSystemSession &session) {
+    if (session.journal.pendingFrees.empty()) {
+        return; // Also ends the early commit that a range added here may start
+    }
+    vector<uint32_t> blocks;
+    blocks.swap(session.journal.pendingFrees);
+    sort(blocks.begin(), blocks.end());
+    blocks.erase(unique(blocks.begin(), blocks.end()), blocks.end());
+    uint64_t limit = journalRangeLimit(session);
+    uint32_t freed = 0;
+    for (size_t start = 0, end; start < blocks.size(); start = end) {
+        for (end = start + 1; end < blocks.size() && (limit == 0 || blocks[end] / 8 - blocks[start] / 8 < limit); end++) {
+        }
+        uint32_t first = blocks[start], last = blocks[end - 1];
+        markMetadataDirty(session, session.superBlock.bitmapOffset + first / 8, last / 8 - first / 8 + 1);
+        for (size_t b = start; b < end; b++) {
+            uint8_t &bits = session.free_blocks[blocks[b] / 8];
+            if (!(bits & (1 << (blocks[b] % 8)))) {
+                bits |= 1 << (blocks[b] % 8);
+                freed++;
+            }
+        }
+    }
+    session.freeBlockCount += freed;
+    updateFreeBlockCount(session);
+}
+
+// Commits the open group and checkpoints it. Data blocks are made durable
+// first, then the group's records are written to the journal and synced,
+// which is the commit point, and only then are the cached directory blocks
+// and the metadata sectors written to their home locations. journalRange()
+// keeps every group within the journal; one that still does not fit is
+// refused rather than checkpointed unlogged. Only images without room for a
+// journal are checkpointed directly. Ends with the image durable.
+int commitJournal(FileSystemSession &session) {
+    JournalState &journal = session.journal;
+    ImageStorage &storage = session.storage;
+    bool logged = false;
+
+    applyPendingFrees(session);
+    if (!journal.pending.empty()) {
+        if (writeBackDirtyBlocks(session, false) != 0 || storageSync(storage) != 0) {
+            LOG_ERROR("Failed to write file data: " << session.imagePath);
+            return -1;
+        }
+
+        vector<uint8_t> group(sizeof(JournalHeader));
+        encodeJournalGroup(session, group);
+        size_t length = group.size() - sizeof(JournalHeader);
+        bool hasJournal = journalRangeLimit(session) > 0;
+        if (hasJournal && length > journalCapacity(session)) {
+            LOG_ERROR("Journal group of " << length << " bytes does not fit the journal: " << session.imagePath);
+            return -1;
+        }
+        if (hasJournal) {
+            JournalHeader header = {JOURNAL_MAGIC, journal.sequence + 1, (uint32_t)length, 0};
+            header.checksum = journalChecksum(header.sequence, group.data() + sizeof(JournalHeader), length);
+            memcpy(group.data(), &header, sizeof(header));
+            if (!storageWrite(storage, session.superBlock.journalOffset, group.data(), group.size()) || storageSync(storage) != 0) {
+                LOG_ERROR("Failed to write journal: " << session.imagePath);
+                return -1;
+            }
+            journal.sequence = header.sequence;
+            journal.commits++;
+            journal.bytesLogged += group.size();
+            logged = true;
+        }
+    }
+
+    if (flushBlockCache(session) != 0) {
+        LOG_ERROR("Failed to write back cached blocks: " << session.imagePath);
+        return -1;
+    }
+    // Without a cache budget the blocks were only held for the group
+    BlockCache &cache = session.blockCache;
+    if (cache.budget < session.superBlock.blockSize) {
+        cache.lru.clear();
+        cache.blocks.clear();
+    }
+    if (session.metadataDirty && flushMetadata(session) != 0) {
+        LOG_ERROR("Failed to write file system metadata: " << session.imagePath);
+        return -1;
+    }
+    if (storageSync(storage) != 0) {
+        LOG_ERROR("Failed to sync file system file: " << session.imagePath);
+        return -1;
+    }
+
+    // The group is home; replaying it again would be harmless, so clearing
+    // the header does not need a sync of its own
+    if (logged) {
+        JournalHeader cleared = {0, journal.sequence, 0, 0};
+        storageWrite(storage, session.superBlock.journalOffset, &cleared, sizeof(cleared));
+    }
+    journal.pending.clear();
+    journal.pendingBytes = 0;
+    journal.groupOperations = 0;
+    return 0;
+}
+
+// Applies a committed group left in the journal by a session that did not
+// get to checkpoint it. Runs before the metadata is loaded.
+static void replayJournal(FileSystemSession &session) {
+    ImageStorage &storage = session.storage;
+    JournalState &journal = session.journal;
+    uint64_t capacity = journalCapacity(session);
+    JournalHeader header;
+    uint64_t journalOffset = session.superBlock.journalOffset;
+    if (capacity == 0 || journalOffset + sizeof(header) + capacity > storage.size ||
+        !storageRead(storage, journalOffset, &header, sizeof(header))) {
+        return;
+    }
+    journal.sequence = header.sequence;
+    if (header.magic != JOURNAL_MAGIC || header.length > capacity) {
+        return;
+    }
+
+    vector<uint8_t> records(header.length);
+    if (!storageRead(storage, journalOffset + sizeof(header), records.data(), records.size()) ||
+        journalChecksum(header.sequence, records.data(), records.size()) != header.checksum) {
+        LOG_WARN("Ignoring incomplete journal group " << header.sequence);
+        return;
+    }
+
+    size_t position = 0, applied = 0;
+    vector<uint8_t> zeros;
+    while (position + sizeof(JournalRecord) <= records.size()) {
+        JournalRecord record;
+        memcpy(&record, records.data() + position, sizeof(record));
+        position += sizeof(record);
+        const uint8_t *data = records.data() + position;
+        if (record.flags & JOURNAL_RECORD_ZERO) {
+            zeros.assign(record.length, 0);
+            data = zeros.data();
+        } else {
+            position += record.length;
+        }
+        if (position > records.size() || (uint64_t)record.offset + record.length > storage.size) {
+            break;
+        }
+        storageWrite(storage, record.offset, data, record.length);
+        applied++;
+    }
+    storageSync(storage);
+
+    JournalHeader cleared = {0, header.sequence, 0, 0};
+    storageWrite(storage, session.superBlock.journalOffset, &cleared, sizeof(cleared));
+    journal.replays++;
+    LOG_WARN("Replayed journal group " << header.sequence << " (" << applied << " records)");
+}
+
+// Commits the open journal group and makes the image durable
+int syncSession(FileSystemSession &session) {
+    unique_lock<shared_mutex> lock(session.metadataLock);
+    return commitJournal(session);
+}
+
+// Session totals of the counters that OperationStats attributes to operations
+static void captureCounters(const FileSystemSession &session, OperationStats &counters) {
+    const IoCounters &io = session.storage.io;
+    counters.reads = io.reads;
+    counters.writes = io.writes;
+    counters.bytesRead = io.bytesRead;
+    counters.bytesWritten = io.bytesWritten;
+    counters.seeks = io.seeks;
+    counters.syncs = io.syncs;
+    counters.fatFlushes = session.fatFlushes;
+    counters.bitmapFlushes = session.bitmapFlushes;
+    counters.directoryBlocksScanned = session.directoryBlocksScanned;
+    counters.journalCommits = session.journal.commits;
+}
+
+// Starts timing an operation of type name; completeOperation() records it
+void beginOperation(FileSystemSession &session, const string &name) {
+    session.currentOperation = name;
+    captureCounters(session, session.operationStart);
+    session.operationStartTime = chrono::steady_clock::now();
+}
+
+static void recordOperation(FileSystemSession &session, int result) {
+    double micros = chrono::duration<double, micro>(chrono::steady_clock::now() - session.operationStartTime).count();
+    OperationStats now;
+    captureCounters(session, now);
+    const OperationStats &start = session.operationStart;
+
+    OperationStats &stats = session.operationStats[session.currentOperation];
+    stats.count++;
+    stats.failures += result != 0;
+    stats.totalMicros += micros;
+    uint32_t bucket = 0;
+    while (bucket + 1 < LATENCY_BUCKETS && micros >= (double)(2ULL << bucket)) {
+        bucket++;
+    }
+    stats.latency[bucket]++;
+    stats.reads += now.reads - start.reads;
+    stats.writes += now.writes - start.writes;
+    stats.bytesRead += now.bytesRead - start.bytesRead;
+    stats.bytesWritten += now.bytesWritten - start.bytesWritten;
+    stats.seeks += now.seeks - start.seeks;
+    stats.syncs += now.syncs - start.syncs;
+    stats.fatFlushes += now.fatFlushes - start.fatFlushes;
+    stats.bitmapFlushes += now.bitmapFlushes - start.bitmapFlushes;
+    stats.directoryBlocksScanned += now.directoryBlocksScanned - start.directoryBlocksScanned;
+    stats.journalCommits += now.journalCommits - start.journalCommits;
+    session.currentOperation.clear();
+}
+
+// Ends one operation. The open journal group is committed once it holds
+// JOURNAL_GROUP_OPERATIONS operations, once its records may pass half of
+// the journal, or once pinned blocks push the block cache over its budget.
+// The operation, including any commit it triggers, is then recorded under
+// the name given to beginOperation().
+int completeOperation(FileSystemSession &session, int result) {
+    JournalState &journal = session.journal;
+    unique_lock<shared_mutex> lock(session.metadataLock);
+    session.operationCount++;
+    int status = 0;
+    if (!journal.pending.empty()) {
+        journal.groupOperations++;
+
+        const BlockCache &cache = session.blockCache;
+        bool overBudget = cache.budget > 0 && cache.blocks.size() * session.superBlock.blockSize > cache.budget;
+        if (journal.groupOperations >= JOURNAL_GROUP_OPERATIONS || journal.pendingBytes > journalCapacity(session) / 2 || overBudget) {
+            status = commitJournal(session);
+        }
+    }
+
+    if (!session.currentOperation.empty()) {
+        recordOperation(session, result != 0 ? result : status);
+    }
+    return status;
+}
+
+// Upper bound in microseconds of the latency below which `fraction` of the
+// recorded operations fall
+static uint64_t latencyPercentile(const OperationStats &stats, double fraction) {
+    uint64_t target = (uint64_t)(stats.count * fraction + 0.5);
+    uint64_t seen = 0;
+    for (uint32_t bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+        seen += stats.latency[bucket];
+        if (seen >= target && seen > 0) {
+            return 2ULL << bucket;
+        }
+    }
+    return 0;
+}
+
+void printSessionStats(const FileSystemSession &session, ostream &out) {
+    out << "Operations: " << session.operationCount << endl;
+    out << "Metadata bytes written: " << session.metadataBytesWritten << endl;
+    out << "Metadata writes: " << session.metadataWrites << endl;
+    if (session.operationCount > 0) {
+        out << "Metadata bytes per operation: " << session.metadataBytesWritten / session.operationCount << endl;
+    }
+    out << "File reads: " << session.fileReads << endl;
+    out << "Data read calls: " << session.dataReadCalls << endl;
+    out << "Data bytes read: " << session.dataBytesRead << endl;
+    if (session.fileReads > 0) {
+        out << "Read I/O calls per file: " << (double)session.dataReadCalls / session.fileReads << endl;
+    }
+    out << "Dentry cache hits: " << session.dentries.hits << endl;
+    out << "Dentry cache misses: " << session.dentries.misses << endl;
+    out << "Dentry cache invalidations: " << session.dentries.invalidations << endl;
+    out << "Chain index hits: " << session.chainIndexes.hits << endl;
+    out << "Chain index misses: " << session.chainIndexes.misses << endl;
+    out << "Chain index invalidations: " << session.chainIndexes.invalidations << endl;
+    out << "Block cache budget: " << session.blockCache.budget << " bytes" << endl;
+    out << "Block cache hits: " << session.blockCache.hits << endl;
+    out << "Block cache misses: " << session.blockCache.misses << endl;
+    out << "Block cache evictions: " << session.blockCache.evictions << endl;
+    out << "Block cache write-backs: " << session.blockCache.writebacks << endl;
+    out << "Journal commits: " << session.journal.commits << endl;
+    out << "Journal bytes logged: " << session.journal.bytesLogged << endl;
+    out << "Journal early commits: " << session.journal.earlyCommits << endl;
+    out << "Journal replays: " << session.journal.replays << endl;
+    const IoCounters &io = session.storage.io;
+    out << "Image reads: " << io.reads << " (" << io.bytesRead << " bytes)" << endl;
+    out << "Image writes: " << io.writes << " (" << io.bytesWritten << " bytes)" << endl;
+    out << "Image seeks: " << io.seeks << endl;
+    out << "Image syncs: " << io.syncs << endl;
+    out << "FAT flushes: " << session.fatFlushes << endl;
+    out << "Bitmap flushes: " << session.bitmapFlushes << endl;
+    out << "Directory blocks scanned: " << session.directoryBlocksScanned << endl;
+
+    if (!session.operationStats.empty()) {
+        out << endl;
+        out << left << setw(10) << "Operation" << right << setw(8) << "Count" << setw(8) << "Failed"
+            << setw(12) << "Mean(us)" << setw(10) << "p50(us)" << setw(10) << "p99(us)"
+            << setw(9) << "Reads" << setw(9) << "Writes" << setw(12) << "BytesRead" << setw(12) << "BytesWrit"
+            << setw(8) << "Seeks" << setw(7) << "Syncs" << setw(6) << "FAT" << setw(8) << "Bitmap"
+            << setw(9) << "DirBlks" << setw(9) << "Commits" << endl;
+        for (const auto &entry : session.operationStats) {
+            const OperationStats &stats = entry.second;
+            out << left << setw(10) << entry.first << right << setw(8) << stats.count << setw(8) << stats.failures
+                << setw(12) << fixed << setprecision(1) << stats.totalMicros / max<uint64_t>(1, stats.count)
+                << defaultfloat << setprecision(6)
+                << setw(10) << latencyPercentile(stats, 0.50) << setw(10) << latencyPercentile(stats, 0.99)
+                << setw(9) << stats.reads << setw(9) << stats.writes << setw(12) << stats.bytesRead << setw(12) << stats.bytesWritten
+                << setw(8) << stats.seeks << setw(7) << stats.syncs << setw(6) << stats.fatFlushes << setw(8) << stats.bitmapFlushes
+                << setw(9) << stats.directoryBlocksScanned << setw(9) << stats.journalCommits << endl;
+        }
+    }
+}
+
+// Same figures as printSessionStats() as one JSON object, with the full
+// latency histogram of each operation type
+void printSessionStatsJson(const FileSystemSession &session, ostream &out) {
+    const IoCounters &io = session.storage.io;
+    out << "{\n";
+    out << "  \"operations\": " << session.operationCount << ",\n";
+    out << "  \"io\": {\"reads\": " << io.reads << ", \"writes\": " << io.writes
+        << ", \"bytesRead\": " << io.bytesRead << ", \"bytesWritten\": " << io.bytesWritten
+        << ", \"seeks\": " << io.seeks << ", \"syncs\": " << io.syncs << "},\n";
+    out << "  \"metadata\": {\"bytesWritten\": " << session.metadataBytesWritten << ", \"writes\": " << session.metadataWrites
+        << ", \"fatFlushes\": " << session.fatFlushes << ", \"bitmapFlushes\": " << session.bitmapFlushes
+        << ", \"directoryBlocksScanned\": " << session.directoryBlocksScanned << "},\n";
+    out << "  \"dentryCache\": {\"hits\": " << session.dentries.hits << ", \"misses\": " << session.dentries.misses
+        << ", \"invalidations\": " << session.dentries.invalidations << "},\n";
+    out << "  \"chainIndex\": {\"hits\": " << session.chainIndexes.hits << ", \"misses\": " << session.chainIndexes.misses
+        << ", \"invalidations\": " << session.chainIndexes.invalidations << "},\n";
+    out << "  \"blockCache\": {\"budget\": " << session.blockCache.budget << ", \"hits\": " << session.blockCache.hits
+        << ", \"misses\": " << session.blockCache.misses << ", \"evictions\": " << session.blockCache.evictions
+        << ", \"writebacks\": " << session.blockCache.writebacks << "},\n";
+    out << "  \"journal\": {\"commits\": " << session.journal.commits << ", \"bytesLogged\": " << session.journal.bytesLogged
+        << ", \"earlyCommits\": " << session.journal.earlyCommits << ", \"replays\": " << session.journal.replays << "},\n";
+    out << "  \"operationStats\": {";
+    bool first = true;
+    for (const auto &entry : session.operationStats) {
+        const OperationStats &stats = entry.second;
+        uint32_t lastBucket = LATENCY_BUCKETS;
+        while (lastBucket > 1 && stats.latency[lastBucket - 1] == 0) {
+            lastBucket--;
+        }
+        out << (first ? "\n" : ",\n") << "    \"" << entry.first << "\": {"
+            << "\"count\": " << stats.count << ", \"failures\": " << stats.failures
+            << ", \"totalUs\": " << stats.totalMicros
+            << ", \"p50Us\": " << latencyPercentile(stats, 0.50) << ", \"p99Us\": " << latencyPercentile(stats, 0.99)
+            << ", \"latencyHistogramUs\": [";
+        for (uint32_t bucket = 0; bucket < lastBucket; bucket++) {
+            out << (bucket ? ", " : "") << stats.latency[bucket];
+        }
+        out << "], \"reads\": " << stats.reads << ", \"writes\": " << stats.writes
+            << ", \"bytesRead\": " << stats.bytesRead << ", \"bytesWritten\": " << stats.bytesWritten
+            << ", \"seeks\": " << stats.seeks << ", \"syncs\": " << stats.syncs
+            << ", \"fatFlushes\": " << stats.fatFlushes << ", \"bitmapFlushes\": " << stats.bitmapFlushes
+            << ", \"directoryBlocksScanned\": " << stats.directoryBlocksScanned
+            << ", \"journalCommits\": " << stats.journalCommits << "}";
+        first = false;
+    }
+    out << (first ? "}\n" : "\n  }\n");
+    out << "}" << endl;
+}
+
+int closeSession(FileSystemSession &session) {
+    if (session.storage.fd < 0) {
+        return 0;
+    }
+    int result = syncSession(session);
+    closeStorage(session.storage);
+    return result;
+}
+
+// Loads 64 bitmap bits; bit n of the result is block word * 64 + n
+static inline uint64_t loadBitmapWord(const uint8_t *free_blocks, uint32_t word) {
+    uint64_t bits;
+    memcpy(&bits, free_blocks + word * 8, sizeof(bits));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    bits = __builtin_bswap64(bits);
+#endif
+    return bits;
+}
+
+// Bits of one bitmap word that stand for blocks in [first, last)
+static inline uint64_t blockRangeMask(uint32_t word, uint32_t first, uint32_t last) {
+    uint64_t bits = ~0ULL;
+    uint32_t base = word * 64;
+    if (first > base) {
+        bits &= first - base >= 64 ? 0 : ~0ULL << (first - base);
+    }
+    if (last < base + 64) {
+        bits &= last <= base ? 0 : ~0ULL >> (base + 64 - last);
+    }
+    return bits;
+}
+
+// Free bits of one bitmap word restricted to blocks in [first, last)
+static inline uint64_t freeBitsInWord(const uint8_t *free_blocks, uint32_t word, uint32_t first, uint32_t last) {
+    return loadBitmapWord(free_blocks, word) & blockRangeMask(word, first, last);
+}
+
+// First free data block according to the bitmap, scanning 64 blocks per step
+int findFreeBlock(const FileSystemSession &session) {
+    const SuperBlock &superBlock = session.superBlock;
+    for (uint32_t word = superBlock.firstDataBlock / 64; word * 64 < superBlock.totalBlocks; word++) {
+        uint64_t bits = freeBitsInWord(session.free_blocks, word, superBlock.firstDataBlock, superBlock.totalBlocks);
+        if (bits) {
+            return word * 64 + __builtin_ctzll(bits);
+        }
+    }
+    return -1;
+}
+
+void initializeAllocator(FileSystemSession &session) {
+    uint32_t first = session.superBlock.firstDataBlock;
+    uint32_t last = session.superBlock.totalBlocks;
+    session.freeBlockCount = 0;
+    for (uint32_t word = first / 64; word * 64 < last; word++) {
+        session.freeBlockCount += __builtin_popcountll(freeBitsInWord(session.free_blocks, word, first, last));
+    }
+    session.allocationCursor = first;
+}
+
+// True if count blocks are free. Blocks freed in the open group only count
+// once it commits, so it is committed early when they are needed.
+static bool enoughFreeBlocks(FileSystemSession &session, uint64_t count) {
+    if (count > session.freeBlockCount && !session.journal.pendingFrees.empty()) {
+        session.journal.earlyCommits++;
+        commitJournal(session);
+    }
+    return count <= session.freeBlockCount;
+}
+
+// Marks freshly allocated blocks as used and updates the free-count summary
+static void claimBlocks(FileSystemSession &session, const vector<uint32_t> &blocks) {
+    for (uint32_t block : blocks) {
+        setBlockFree(session, block, false);
+    }
+    session.freeBlockCount -= blocks.size();
+    updateFreeBlockCount(session);
+}
+
+// Allocates count blocks in one next-fit pass over the bitmap. The blocks are
+// marked used and returned in ascending order from the cursor; their FAT
+// entries are left for the caller to link. Nothing is allocated on failure.
+bool allocateBlocks(FileSystemSession &session, uint32_t count, vector<uint32_t> &blocks) {
+    blocks.clear();
+    if (!enoughFreeBlocks(session, count)) {
+        return false;
+    }
+
+    uint32_t first = session.superBlock.firstDataBlock;
+    uint32_t last = session.superBlock.totalBlocks;
+    uint32_t cursor = max(session.allocationCursor, first);
+    if (cursor >= last) {
+        cursor = first;
+    }
+
+    blocks.reserve(count);
+    // Scan [cursor, last) and then wrap around to [first, cursor)
+    uint32_t ranges[2][2] = {{cursor, last}, {first, cursor}};
+    for (int r = 0; r < 2 && blocks.size() < count; r++) {
+        uint32_t from = ranges[r][0], to = ranges[r][1];
+        for (uint32_t word = from / 64; word * 64 < to && blocks.size() < count; word++) {
+            uint64_t bits = freeBitsInWord(session.free_blocks, word, from, to);
+            while (bits && blocks.size() < count) {
+                blocks.push_back(word * 64 + __builtin_ctzll(bits));
+                bits &= bits - 1;
+            }
+        }
+    }
+
+    claimBlocks(session, blocks);
+    session.allocationCursor = blocks.empty() ? cursor : blocks.back() + 1;
+    return true;
+}
+
+// First block in [from, to) whose bitmap bit equals isFree, or to if none
+static uint32_t findNextBlock(const uint8_t *free_blocks, uint32_t from, uint32_t to, bool isFree) {
+    for (uint32_t word = from / 64; word * 64 < to; word++) {
+        uint64_t bits = loadBitmapWord(free_blocks, word);
+        if (!isFree) {
+            bits = ~bits;
+        }
+        if (from > word * 64) {
+            bits &= ~0ULL << (from - word * 64);
+        }
+        if (bits) {
+            return min(to, word * 64 + __builtin_ctzll(bits));
+        }
+    }
+    return to;
+}
+
+// Lists every maximal run of free data blocks in ascending block order
+void collectFreeRuns(const FileSystemSession &session, vector<BlockRun> &runs) {
+    uint32_t last = session.superBlock.totalBlocks;
+    uint32_t block = session.superBlock.firstDataBlock;
+    runs.clear();
+    while (block < last) {
+        uint32_t start = findNextBlock(session.free_blocks, block, last, true);
+        if (start >= last) {
+            break;
+        }
+        uint32_t end = findNextBlock(session.free_blocks, start, last, false);
+        runs.push_back({start, end - start});
+        block = end;
+    }
+}
+
+// Allocates count blocks laid out as few contiguous extents as possible.
+// A single best-fit run is preferred; otherwise the largest runs are taken
+// and the remainder goes to the best-fitting run left. Extents are returned
+// in ascending block order so the file reads sequentially.
+bool allocateExtents(FileSystemSession &session, uint32_t count, vector<uint32_t> &blocks) {
+    blocks.clear();
+    if (!enoughFreeBlocks(session, count)) {
+        return false;
+    }
+
+    vector<BlockRun> runs;
+    collectFreeRuns(session, runs);
+    sort(runs.begin(), runs.end(), [](const BlockRun &a, const BlockRun &b) {
+        return a.length != b.length ? a.length > b.length : a.start < b.start;
+    });
+
+    vector<BlockRun> extents;
+    uint32_t remaining = count;
+    size_t next = 0;
+    while (remaining > 0 && next < runs.size()) {
+        // Smallest unused run that still holds everything that is left
+        size_t fit = runs.size();
+        for (size_t r = next; r < runs.size() && runs[r].length >= remaining; r++) {
+            fit = r;
+        }
+        if (fit < runs.size()) {
+            extents.push_back({runs[fit].start, remaining});
+            remaining = 0;
+        } else {
+            extents.push_back(runs[next]);
+            remaining -= runs[next].length;
+            next++;
+        }
+    }
+    if (remaining > 0) {
+        return false;
+    }
+
+    sort(extents.begin(), extents.end(), [](const BlockRun &a, const BlockRun &b) {
+        return a.start < b.start;
+    });
+    blocks.reserve(count);
+    for (const BlockRun &extent : extents) {
+        for (uint32_t b = 0; b < extent.length; b++) {
+            blocks.push_back(extent.start + b);
+        }
+    }
+    claimBlocks(session, blocks);
+    return true;
+}
+
+// Allocates count blocks to extend the chain ending at tail: the free
+// blocks right after tail first, so that the chain keeps growing in place,
+// and the rest from the next-fit cursor. Neither step scans more of the
+// bitmap than it hands out.
+static bool allocateAfter(FileSystemSession &session, uint32_t tail, uint32_t count, vector<uint32_t> &blocks) {
+    blocks.clear();
+    if (!enoughFreeBlocks(session, count)) {
+        return false;
+    }
+    uint32_t from = tail + 1;
+    uint32_t to = min<uint64_t>(session.superBlock.totalBlocks, (uint64_t)from + count);
+    uint32_t end = findNextBlock(session.free_blocks, from, to, false);
+    for (uint32_t block = from; block < end; block++) {
+        blocks.push_back(block);
+    }
+    claimBlocks(session, blocks);
+    if (!blocks.empty()) {
+        session.allocationCursor = end;
+    }
+    if (blocks.size() < count) {
+        vector<uint32_t> rest;
+        allocateBlocks(session, count - blocks.size(), rest);
+        blocks.insert(blocks.end(), rest.begin(), rest.end());
+    }
+    return true;
+}
+
+// Allocates one block and terminates its chain
+int allocateBlock(FileSystemSession &session) {
+    vector<uint32_t> blocks;
+    if (!allocateBlocks(session, 1, blocks)) {
+        return -1;
+    }
+    setFATEntry(session, blocks[0], FAT_END);
+    return blocks[0];
+}
+
+// Frees one block. Its bitmap bit is set when the open group commits, see
+// applyPendingFrees().
+void releaseBlock(FileSystemSession &session, uint32_t block) {
+    if (block < session.superBlock.firstDataBlock || block >= session.superBlock.totalBlocks) {
+        return;
+    }
+    setFATEntry(session, block, FAT_FREE);
+    session.journal.pendingFrees.push_back(block);
+}
+
+static inline uint32_t entriesPerBlock(const FileSystemSession &session) {
+    return session.superBlock.blockSize / sizeof(DirectoryEntry);
+}
+
+static inline uint64_t directorySlotOffset(const FileSystemSession &session, const DirectorySlot &slot) {
+    return blockOffset(session, slot.block) + slot.index * sizeof(DirectoryEntry);
+}
+
+// FNV-1a over the name as returned by directoryEntryName()
+static uint32_t hashEntryName(string_view name) {
+    uint32_t hash = 2166136261u;
+    for (unsigned char c : name) {
+        hash ^= c;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static inline uint32_t encodeSlot(const DirectorySlot &slot) {
+    return slot.block * DIRECTORY_SLOT_STRIDE + slot.index + 1;
+}
+
+static inline DirectorySlot decodeSlot(uint32_t value) {
+    DirectorySlot slot = {(value - 1) / DIRECTORY_SLOT_STRIDE, (value - 1) % DIRECTORY_SLOT_STRIDE};
+    return slot;
+}
+
+static inline uint64_t dentryKey(uint32_t dirBlock, string_view name) {
+    return (uint64_t)dirBlock << 32 | hashEntryName(name);
+}
+
+// Cached slot for name in dirBlock, if it still holds that name. The slot
+// is read without cacheMutex held, so the node is looked up again after.
+static bool lookupDentry(FileSystemSession &session, uint32_t dirBlock, string_view name, DirectoryEntry &entry, DirectorySlot &slot) {
+    DentryCache &cache = session.dentries;
+    uint64_t key = dentryKey(dirBlock, name);
+    {
+        lock_guard<mutex> guard(session.cacheMutex);
+        auto it = cache.nodes.find(key);
+        if (it == cache.nodes.end() || it->second->name != name) {
+            cache.misses++;
+            return false;
+        }
+        slot = it->second->slot;
+    }
+    bool valid = blockCacheRead(session, directorySlotOffset(session, slot), &entry, sizeof(DirectoryEntry)) &&
+                 entry.filename[0] != 0 && directoryEntryNameEquals(entry, name);
+
+    lock_guard<mutex> guard(session.cacheMutex);
+    auto it = cache.nodes.find(key);
+    bool sameNode = it != cache.nodes.end() && it->second->slot.block == slot.block && it->second->slot.index == slot.index;
+    if (!valid) {
+        if (sameNode) {
+            cache.lru.erase(it->second);
+            cache.nodes.erase(it);
+            cache.invalidations++;
+        }
+        cache.misses++;
+        return false;
+    }
+    if (sameNode) {
+        cache.lru.splice(cache.lru.begin(), cache.lru, it->second);
+    }
+    cache.hits++;
+    return true;
+}
+
+static void insertDentry(FileSystemSession &session, uint32_t dirBlock, string_view name, const DirectorySlot &slot) {
+    DentryCache &cache = session.dentries;
+    lock_guard<mutex> guard(session.cacheMutex);
+    if (cache.capacity == 0) {
+        return;
+    }
+    uint64_t key = dentryKey(dirBlock, name);
+    auto it = cache.nodes.find(key);
+    if (it != cache.nodes.end()) {
+        it->second->name.assign(name.data(), name.size());
+        it->second->slot = slot;
+        cache.lru.splice(cache.lru.begin(), cache.lru, it->second);
+        return;
+    }
+    if (cache.nodes.size() >= cache.capacity) {
+        cache.nodes.erase(cache.lru.back().key);
+        cache.lru.pop_back();
+    }
+    cache.lru.push_front({key, string(name), slot});
+    cache.nodes[key] = cache.lru.begin();
+}
+
+static void eraseDentry(FileSystemSession &session, uint32_t dirBlock, string_view name) {
+    DentryCache &cache = session.dentries;
+    lock_guard<mutex> guard(session.cacheMutex);
+    auto it = cache.nodes.find(dentryKey(dirBlock, name));
+    if (it != cache.nodes.end()) {
+        cache.lru.erase(it->second);
+        cache.nodes.erase(it);
+        cache.invalidations++;
+    }
+}
+
+// Drops every cached name inside the directories being released, in one
+// pass over the cache however many directories there are
+static void eraseDirectoryDentries(FileSystemSession &session, const unordered_set<uint32_t> &dirBlocks) {
+    DentryCache &cache = session.dentries;
+    lock_guard<mutex> guard(session.cacheMutex);
+    for (auto it = cache.lru.begin(); it != cache.lru.end();) {
+        if (dirBlocks.count((uint32_t)(it->key >> 32))) {
+            cache.nodes.erase(it->key);
+            it = cache.lru.erase(it);
+            cache.invalidations++;
+        } else {
+            ++it;
+        }
+    }
+}
+
+// Reading directory entries from a specific block
+vector<DirectoryEntry> readDirectoryEntries(FileSystemSession &session, uint32_t block) {
+    session.directoryBlocksScanned++;
+    vector<DirectoryEntry> entries(entriesPerBlock(session));
+    blockCacheRead(session, blockOffset(session, block), entries.data(), entries.size() * sizeof(DirectoryEntry));
+
+    return entries;
+}
+
+// The per-block directory scans, compiled for one block size so the entry
+// count and the block offset are constants and the entries live on the stack
+template <uint32_t BlockSize>
+struct DirectoryBlockScan {
+    typedef BlockGeometry<BlockSize> Geometry;
+    typedef DirectoryEntry Entries[Geometry::entriesPerBlock];
+
+    static bool load(FileSystemSession &session, uint32_t block, Entries &entries) {
+        session.directoryBlocksScanned++;
+        return blockCacheRead(session, (uint64_t)block << Geometry::shift, entries, sizeof(Entries));
+    }
+
+    static int findName(FileSystemSession &session, uint32_t block, uint32_t first, string_view name, DirectoryEntry &entry) {
+        Entries entries;
+        if (!load(session, block, entries)) {
+            return -1;
+        }
+        for (uint32_t i = first; i < Geometry::entriesPerBlock; i++) {
+            if (entries[i].filename[0] != 0 && directoryEntryNameEquals(entries[i], name)) {
+                entry = entries[i];
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    static int findFree(FileSystemSession &session, uint32_t block, uint32_t first, uint32_t limit) {
+        Entries entries;
+        if (!load(session, block, entries)) {
+            return -1;
+        }
+        for (uint32_t i = first; i < limit && i < Geometry::entriesPerBlock; i++) {
+            if (entries[i].filename[0] == 0) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    static void collect(FileSystemSession &session, uint32_t block, uint32_t first, vector<DirectoryEntry> &found,
+                        vector<DirectorySlot> *slots) {
+        Entries entries;
+        if (!load(session, block, entries)) {
+            return;
+        }
+        for (uint32_t i = first; i < Geometry::entriesPerBlock; i++) {
+            if (entries[i].filename[0] != 0) {
+                found.push_back(entries[i]);
+                if (slots) {
+                    slots->push_back({block, i});
+                }
+            }
+        }
+    }
+};
+
+template <uint32_t BlockSize>
+static const DirectoryOps directoryBlockOps = {
+    DirectoryBlockScan<BlockSize>::findName,
+    DirectoryBlockScan<BlockSize>::findFree,
+    DirectoryBlockScan<BlockSize>::collect,
+};
+
+// Scans for an image's block size; validSuperBlock() admits no other sizes
+static const DirectoryOps *selectDirectoryOps(uint32_t blockSize) {
+    switch (blockSize) {
+    case BLOCK_SIZE_512:
+        return &directoryBlockOps<BLOCK_SIZE_512>;
+    case BLOCK_SIZE_1024:
+        return &directoryBlockOps<BLOCK_SIZE_1024>;
+    case BLOCK_SIZE_2048:
+        return &directoryBlockOps<BLOCK_SIZE_2048>;
+    default:
+        return &directoryBlockOps<BLOCK_SIZE_4096>;
+    }
+}
+
+// Blocks of a directory chain in order. The root directory sits just below
+// firstDataBlock, so only the first block may be outside the data area.
+void directoryChain(const FileSystemSession &session, uint32_t firstBlock, vector<uint32_t> &blocks) {
+    blocks.clear();
+    uint32_t block = firstBlock;
+    while (blocks.size() < session.superBlock.totalBlocks) {
+        blocks.push_back(block);
+        uint32_t next = readFAT12Entry(session, block);
+        if (next == FAT_END || next == FAT_FREE || next < session.superBlock.firstDataBlock || next >= session.superBlock.totalBlocks) {
+            break;
+        }
+        block = next;
+    }
+}
+
+bool readDirectoryHeader(FileSystemSession &session, uint32_t dirBlock, DirectoryHeader &header) {
+    return blockCacheRead(session, blockOffset(session, dirBlock), &header, sizeof(header)) &&
+           header.mark == DIRECTORY_HEADER_MARK;
+}
+
+static bool writeDirectoryHeader(FileSystemSession &session, uint32_t dirBlock, const DirectoryHeader &header) {
+    return journaledWrite(session, blockOffset(session, dirBlock), &header, sizeof(header));
+}
+
+// Clears a directory block. The first block of a directory gets the header.
+bool initializeDirectoryBlock(FileSystemSession &session, uint32_t block, bool withHeader) {
+    vector<uint8_t> buffer(session.superBlock.blockSize, 0);
+    if (withHeader) {
+        DirectoryHeader header = {};
+        header.mark = DIRECTORY_HEADER_MARK;
+        header.tailBlock = block;
+        header.tailUsed = 1;
+        memcpy(buffer.data(), &header, sizeof(header));
+    }
+    return journaledWrite(session, blockOffset(session, block), buffer.data(), buffer.size());
+}
+
+// Reads every live entry of a directory, optionally with its location
+void listDirectory(FileSystemSession &session, uint32_t dirBlock, vector<DirectoryEntry> &entries, vector<DirectorySlot> *slots) {
+    entries.clear();
+    if (slots) {
+        slots->clear();
+    }
+
+    DirectoryHeader header;
+    bool hasHeader = readDirectoryHeader(session, dirBlock, header);
+    vector<uint32_t> chain;
+    directoryChain(session, dirBlock, chain);
+
+    for (uint32_t block : chain) {
+        session.directoryOps->collect(session, block, (hasHeader && block == dirBlock) ? 1 : 0, entries, slots);
+    }
+}
+
+static bool readIndexBucket(FileSystemSession &session, const DirectoryHeader &header, uint32_t bucket, uint32_t &value) {
+    uint64_t offset = blockOffset(session, header.indexBlock) + bucket * sizeof(uint32_t);
+    return blockCacheRead(session, offset, &value, sizeof(value));
+}
+
+static bool writeIndexBucket(FileSystemSession &session, const DirectoryHeader &header, uint32_t bucket, uint32_t value) {
+    uint64_t offset = blockOffset(session, header.indexBlock) + bucket * sizeof(uint32_t);
+    return journaledWrite(session, offset, &value, sizeof(value));
+}
+
+// Rebuilds the hash index of a directory with room for four times its live
+// entries. The index is one contiguous run so a bucket is found by offset;
+// if no such run is free the directory falls back to linear scans.
+static bool rebuildDirectoryIndex(FileSystemSession &session, uint32_t dirBlock, DirectoryHeader &header) {
+    uint32_t blockSize = session.superBlock.blockSize;
+
+    // The old index is released only after the new one is written, so the
+    // committed header never points at blocks that are being rewritten
+    uint32_t oldIndexBlock = header.indexBlock;
+    header.indexBlock = 0;
+    header.indexBlockCount = 0;
+    header.bucketCount = 0;
+    header.usedBuckets = 0;
+
+    vector<DirectoryEntry> entries;
+    vector<DirectorySlot> slots;
+    listDirectory(session, dirBlock, entries, &slots);
+
+    uint32_t bucketCount = blockSize / sizeof(uint32_t);
+    while (bucketCount < entries.size() * 4) {
+        bucketCount *= 2;
+    }
+    vector<uint32_t> buckets(bucketCount, INDEX_BUCKET_EMPTY);
+    for (size_t e = 0; e < entries.size(); e++) {
+        uint32_t bucket = hashEntryName(directoryEntryName(entries[e])) & (bucketCount - 1);
+        while (buckets[bucket] != INDEX_BUCKET_EMPTY) {
+            bucket = (bucket + 1) & (bucketCount - 1);
+        }
+        buckets[bucket] = encodeSlot(slots[e]);
+    }
+
+    uint32_t blockCount = bucketCount * sizeof(uint32_t) / blockSize;
+    vector<uint32_t> blocks;
+    bool built = allocateExtents(session, blockCount, blocks);
+    if (built) {
+        for (size_t b = 0; b < blocks.size(); b++) {
+            setFATEntry(session, blocks[b], b + 1 < blocks.size() ? blocks[b + 1] : FAT_END);
+        }
+        // Freshly allocated blocks are written like file data, ahead of the
+        // journal commit that makes the header point at them
+        built = blocks.back() - blocks.front() + 1 == blockCount &&
+                blockCacheWrite(session, blockOffset(session, blocks[0]), buckets.data(), buckets.size() * sizeof(uint32_t));
+        if (!built) {
+            releaseChain(session, blocks[0]);
+        }
+    }
+    if (oldIndexBlock != 0) {
+        releaseChain(session, oldIndexBlock);
+    }
+    if (!built) {
+        return false;
+    }
+
+    header.indexBlock = blocks[0];
+    header.indexBlockCount = blockCount;
+    header.bucketCount = bucketCount;
+    header.usedBuckets = entries.size();
+    return true;
+}
+
+// Looks up name in a directory: in the dentry cache first, then through the
+// hash index when the directory has one, otherwise by scanning its chain
+bool findDirectoryEntry(FileSystemSession &session, uint32_t dirBlock, string_view name, DirectoryEntry &entry, DirectorySlot &slot) {
+    if (lookupDentry(session, dirBlock, name, entry, slot)) {
+        return true;
+    }
+
+    DirectoryHeader header;
+    bool hasHeader = readDirectoryHeader(session, dirBlock, header);
+
+    if (hasHeader && header.indexBlock != 0) {
+        uint32_t mask = header.bucketCount - 1;
+        uint32_t bucket = hashEntryName(name) & mask;
+        for (uint32_t probe = 0; probe < header.bucketCount; probe++, bucket = (bucket + 1) & mask) {
+            uint32_t value;
+            if (!readIndexBucket(session, header, bucket, value) || value == INDEX_BUCKET_EMPTY) {
+                return false;
+            }
+            if (value == INDEX_BUCKET_TOMBSTONE) {
+                continue;
+            }
+            slot = decodeSlot(value);
+            if (blockCacheRead(session, directorySlotOffset(session, slot), &entry, sizeof(DirectoryEntry)) &&
+                entry.filename[0] != 0 && directoryEntryNameEquals(entry, name)) {
+                insertDentry(session, dirBlock, name, slot);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    vector<uint32_t> chain;
+    directoryChain(session, dirBlock, chain);
+    for (uint32_t block : chain) {
+        int index = session.directoryOps->findName(session, block, (hasHeader && block == dirBlock) ? 1 : 0, name, entry);
+        if (index >= 0) {
+            slot = {block, (uint32_t)index};
+            insertDentry(session, dirBlock, name, slot);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Writes one entry in place without touching the rest of its block
+bool writeDirectoryEntry(FileSystemSession &session, const DirectorySlot &slot, const DirectoryEntry &entry) {
+    return journaledWrite(session, directorySlotOffset(session, slot), &entry, sizeof(DirectoryEntry));
+}
+
+// Adds an entry to a directory. Cleared slots are reused first, then the
+// tail block is filled, and when it is full the chain grows by one block.
+// A directory gets its hash index as soon as it spans more than one block.
+bool addDirectoryEntry(FileSystemSession &session, uint32_t dirBlock, const DirectoryEntry &entry) {
+    DirectoryHeader header;
+    bool hasHeader = readDirectoryHeader(session, dirBlock, header);
+    uint32_t perBlock = entriesPerBlock(session);
+    DirectorySlot slot = {0, 0};
+    bool haveSlot = false;
+    vector<uint32_t> chain;
+
+    if (!hasHeader || header.freeSlots > 0) {
+        directoryChain(session, dirBlock, chain);
+        for (size_t c = 0; c < chain.size() && !haveSlot; c++) {
+            uint32_t block = chain[c];
+            uint32_t limit = (hasHeader && block == header.tailBlock) ? header.tailUsed : perBlock;
+            int index = session.directoryOps->findFree(session, block, (hasHeader && block == dirBlock) ? 1 : 0, limit);
+            if (index >= 0) {
+                slot = {block, (uint32_t)index};
+                haveSlot = true;
+            }
+        }
+        if (hasHeader) {
+            header.freeSlots = haveSlot ? header.freeSlots - 1 : 0;
+        }
+    }
+
+    if (!haveSlot && hasHeader && header.tailUsed < perBlock) {
+        slot = {header.tailBlock, header.tailUsed++};
+        haveSlot = true;
+    }
+
+    if (!haveSlot) {
+        uint32_t tail = hasHeader ? header.tailBlock : chain.back();
+        int newBlock = allocateBlock(session);
+        if (newBlock == -1 || !initializeDirectoryBlock(session, newBlock, false)) {
+            LOG_ERROR("No free blocks available to grow directory: " << dirBlock);
+            if (newBlock != -1) {
+                releaseBlock(session, newBlock);
+            }
+            return false;
+        }
+        setFATEntry(session, tail, newBlock);
+        slot = {(uint32_t)newBlock, 0};
+        if (hasHeader) {
+            header.tailBlock = newBlock;
+            header.tailUsed = 1;
+        }
+    }
+
+    if (!writeDirectoryEntry(session, slot, entry)) {
+        LOG_ERROR("Failed to write directory entry in block: " << slot.block);
+        return false;
+    }
+
+    if (hasHeader) {
+        header.entryCount++;
+        if (header.indexBlock != 0 && (header.usedBuckets + 1) * 2 <= header.bucketCount) {
+            uint32_t mask = header.bucketCount - 1;
+            uint32_t bucket = hashEntryName(directoryEntryName(entry)) & mask;
+            uint32_t value = INDEX_BUCKET_EMPTY;
+            while (readIndexBucket(session, header, bucket, value) &&
+                   value != INDEX_BUCKET_EMPTY && value != INDEX_BUCKET_TOMBSTONE) {
+                bucket = (bucket + 1) & mask;
+            }
+            if (value == INDEX_BUCKET_EMPTY) {
+                header.usedBuckets++;
+            }
+            writeIndexBucket(session, header, bucket, encodeSlot(slot));
+        } else if (header.indexBlock != 0 || header.tailBlock != dirBlock) {
+            rebuildDirectoryIndex(session, dirBlock, header);
+        }
+        writeDirectoryHeader(session, dirBlock, header);
+    }
+
+    string name = directoryEntryName(entry);
+    insertDentry(session, dirBlock, name, slot);
+    LOG_DEBUG("Added directory entry for: " << name << " in block: " << slot.block);
+    return true;
+}
+
+// Clears the entry at slot and drops it from the hash index
+bool removeDirectoryEntry(FileSystemSession &session, uint32_t dirBlock, const DirectorySlot &slot) {
+    DirectoryEntry entry;
+    if (!blockCacheRead(session, directorySlotOffset(session, slot), &entry, sizeof(DirectoryEntry))) {
+        return false;
+    }
+    string name = directoryEntryName(entry);
+    eraseDentry(session, dirBlock, name);
+
+    DirectoryEntry emptyEntry;
+    memset(&emptyEntry, 0, sizeof(DirectoryEntry));
+    if (!writeDirectoryEntry(session, slot, emptyEntry)) {
+        return false;
+    }
+
+    DirectoryHeader header;
+    if (!readDirectoryHeader(session, dirBlock, header)) {
+        return true;
+    }
+    header.entryCount--;
+    header.freeSlots++;
+    if (header.indexBlock != 0) {
+        uint32_t mask = header.bucketCount - 1;
+        uint32_t bucket = hashEntryName(name) & mask;
+        uint32_t target = encodeSlot(slot);
+        for (uint32_t probe = 0; probe < header.bucketCount; probe++, bucket = (bucket + 1) & mask) {
+            uint32_t value;
+            if (!readIndexBucket(session, header, bucket, value) || value == INDEX_BUCKET_EMPTY) {
+                break;
+            }
+            if (value == target) {
+                writeIndexBucket(session, header, bucket, INDEX_BUCKET_TOMBSTONE);
+                break;
+            }
+        }
+    }
+    return writeDirectoryHeader(session, dirBlock, header);
+}
+
+// Frees a directory's chain and hash index. The blocks are not cleared:
+// every path that reuses a block as a directory initializes it first.
+void releaseDirectory(FileSystemSession &session, uint32_t dirBlock) {
+    eraseDirectoryDentries(session, {dirBlock});
+    vector<uint32_t> chains = {dirBlock};
+    DirectoryHeader header;
+    if (readDirectoryHeader(session, dirBlock, header) && header.indexBlock != 0) {
+        chains.push_back(header.indexBlock);
+    }
+    releaseChains(session, chains);
+}
+
+// Next non-empty backslash-separated component of path at or after position
+bool nextPathComponent(string_view path, size_t &position, string_view &component) {
+    while (position < path.size()) {
+        size_t end = path.find('\\', position);
+        if (end == string_view::npos) {
+            end = path.size();
+        }
+        component = path.substr(position, end - position);
+        position = end + 1;
+        if (!component.empty()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Walks every component but the last from the root directory and looks the
+// last one up in the directory that holds it. Returns -1 when an intermediate
+// component is missing or is not a directory; a missing last component is
+// reported through resolved.found so callers can create it.
+int resolvePath(FileSystemSession &session, string_view path, ResolvedPath &resolved) {
+    resolved.parentBlock = session.superBlock.rootDirectory;
+    resolved.name = string_view();
+    resolved.found = false;
+
+    size_t position = 0;
+    string_view component;
+    bool more = nextPathComponent(path, position, component);
+    while (more) {
+        string_view next;
+        more = nextPathComponent(path, position, next);
+        resolved.name = component;
+        resolved.found = findDirectoryEntry(session, resolved.parentBlock, component, resolved.entry, resolved.slot);
+        if (!more) {
+            break;
+        }
+        if (!resolved.found) {
+            LOG_ERROR("Directory not found: " << component);
+            return -1;
+        }
+        if (!resolved.entry.attributes.is_directory) {
+            LOG_ERROR("Not a directory: " << component);
+            return -1;
+        }
+        resolved.parentBlock = entryFirstBlock(session.superBlock, resolved.entry);
+        component = next;
+    }
+    return 0;
+}
+
+// Fills a new directory entry; names keep at most 7 characters
+static void initializeDirectoryEntry(const SuperBlock &superBlock, DirectoryEntry &newDir, string_view name, uint32_t block) {
+    memset(&newDir, 0, sizeof(DirectoryEntry));
+    memcpy(newDir.filename, name.data(), min(name.size(), sizeof(newDir.filename) - 1));
+    newDir.attributes.is_directory = 1;
+    newDir.attributes.read_permission = 1;
+    newDir.attributes.write_permission = 1;
+    newDir.creation_date = {1, 1, 40}; // Date: 01/01/1980
+    newDir.last_modification_date = newDir.creation_date;
+    setEntryFirstBlock(superBlock, newDir, block);
+    newDir.file_size = 0;
+}
+
+int mkdir(FileSystemSession &session, const string &path) {
+    unique_lock<shared_mutex> lock(session.metadataLock);
+    ResolvedPath resolved;
+    if (resolvePath(session, path, resolved) != 0) {
+        return -1;
+    }
+    if (resolved.name.empty()) {
+        LOG_ERROR("Invalid directory path: " << path);
+        return -1;
+    }
+    if (resolved.found) {
+        LOG_ERROR("Directory already exists: " << resolved.name);
+        return -1;
+    }
+
+    int freeBlock = allocateBlock(session);
+    if (freeBlock == -1) {
+        LOG_ERROR("No free blocks available");
+        return -1;
+    }
+
+    DirectoryEntry newDir;
+    initializeDirectoryEntry(session.superBlock, newDir, resolved.name, freeBlock);
+
+    // Initialize new directory block with its header and no entries
+    if (!initializeDirectoryBlock(session, freeBlock, true)) {
+        releaseBlock(session, freeBlock);
+        return -1;
+    }
+    LOG_DEBUG("Initialized new directory block: " << freeBlock);
+
+    // Write the new directory entry
+    if (!addDirectoryEntry(session, resolved.parentBlock, newDir)) {
+        releaseBlock(session, freeBlock);
+        return -1;
+    }
+
+    cout << "Directory created successfully." << endl;
+
+    return 0;
+}
+
+// Updated dir function
+void dir(FileSystemSession &session, const string &path) {
+    shared_lock<shared_mutex> lock(session.metadataLock);
+    uint32_t currentBlock = session.superBlock.rootDirectory;
+
+    ResolvedPath resolved;
+    if (resolvePath(session, path, resolved) != 0) {
+        return;
+    }
+    if (!resolved.name.empty()) {
+        if (!resolved.found || !resolved.entry.attributes.is_directory) {
+            LOG_ERROR("Directory not found: " << resolved.name);
+            return;
+        }
+        currentBlock = entryFirstBlock(session.superBlock, resolved.entry);
+    }
+
+    vector<DirectoryEntry> entries;
+    listDirectory(session, currentBlock, entries);
+
+    cout << "Permissions  Size       Creation Date       Modification Date    Password  Name\n";
+    cout << "--------------------------------------------------------------------------------\n";
+
+    for (const auto &entry : entries) {
+        if (entry.filename[0] != 0) { // Only print non-empty entries
+            string fullName = directoryEntryName(entry);
+
+            string permissions = "";
+            permissions += (entry.attributes.read_permission ? "r" : "-");
+            permissions += (entry.attributes.write_permission ? "w" : "-");
+            permissions += (entry.attributes.is_directory ? "d" : "-");
+
+            cout << permissions << "      "
+                 << entry.file_size << "       "
+                 << entry.creation_date.year + 1980 << "-"
+                 << (int)entry.creation_date.month << "-"
+                 << (int)entry.creation_date.day << "       "
+                 << entry.last_modification_date.year + 1980 << "-"
+                 << (int)entry.last_modification_date.month << "-"
+                 << (int)entry.last_modification_date.day << "       "
+                 << (entry.attributes.is_protected ? "Yes" : "No") << "        "
+                 << fullName << "\n";
+        }
+    }
+}
+
+// Remove directory function
+int rmdir(FileSystemSession &session, const string &path) {
+    unique_lock<shared_mutex> lock(session.metadataLock);
+    ResolvedPath resolved;
+    if (resolvePath(session, path, resolved) != 0) {
+        return -1;
+    }
+    if (resolved.name.empty()) {
+        LOG_ERROR("Cannot remove the root directory");
+        return -1;
+    }
+    if (!resolved.found) {
+        LOG_ERROR("Directory not found: " << resolved.name);
+        return -1;
+    }
+    LOG_DEBUG("Found directory: " << resolved.name << " in block: " << resolved.parentBlock);
+
+    if (!resolved.entry.attributes.is_directory) {
+        LOG_ERROR("Not a directory: " << resolved.name);
+        return -1;
+    }
+
+    // Check if directory is empty
+    uint32_t dirBlock = entryFirstBlock(session.superBlock, resolved.entry);
+    vector<DirectoryEntry> subEntries;
+    listDirectory(session, dirBlock, subEntries);
+    if (!subEntries.empty()) {
+        LOG_ERROR("Directory not empty: " << resolved.name);
+        return -1;
+    }
+
+    removeDirectoryEntry(session, resolved.parentBlock, resolved.slot);
+    LOG_DEBUG("Cleared directory entry for: " << resolved.name << " in block: " << resolved.parentBlock);
+
+    // Free the directory's block chain and its name index
+    releaseDirectory(session, dirBlock);
+    LOG_DEBUG("Marked block " << dirBlock << " as free");
+
+    cout << "Directory removed successfully." << endl;
+    return 0;
+}
+
+// Adds the chains below dirBlock to chains, and the directories themselves,
+// dirBlock included, to directories: directory chains and hash indexes as
+// well as file chains. Fails on a directory loop in a damaged image.
+static bool collectSubtree(FileSystemSession &session, uint32_t dirBlock, const string &path, vector<uint32_t> &chains,
+                           unordered_set<uint32_t> &directories) {
+    if (!directories.insert(dirBlock).second) {
+        LOG_ERROR("Directory loop at " << path);
+        return false;
+    }
+    chains.push_back(dirBlock);
+    DirectoryHeader header;
+    if (readDirectoryHeader(session, dirBlock, header) && header.indexBlock != 0) {
+        chains.push_back(header.indexBlock);
+    }
+
+    vector<DirectoryEntry> entries;
+    listDirectory(session, dirBlock, entries);
+    for (const DirectoryEntry &entry : entries) {
+        if (!entry.attributes.is_directory) {
+            chains.push_back(entryFirstBlock(session.superBlock, entry));
+        } else if (!collectSubtree(session, entryFirstBlock(session.superBlock, entry), path + "\\" + directoryEntryName(entry), chains, directories)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Removes a file or, with recursive, a directory and everything below it.
+// Only the top entry is cleared from its parent; the chains of the whole
+// subtree are then freed by one releaseChains() call, so the operation's
+// metadata changes are a few ranges in one journal group however many
+// files the tree holds.
+int rm(FileSystemSession &session, const string &path, bool recursive) {
+    unique_lock<shared_mutex> lock(session.metadataLock);
+    ResolvedPath resolved;
+    if (resolvePath(session, path, resolved) != 0) {
+        return -1;
+    }
+    if (resolved.name.empty()) {
+        LOG_ERROR("Cannot remove the root directory");
+        return -1;
+    }
+    if (!resolved.found) {
+        LOG_ERROR("File not found: " << resolved.name);
+        return -1;
+    }
+
+    vector<uint32_t> chains;
+    unordered_set<uint32_t> directories;
+    if (!resolved.entry.attributes.is_directory) {
+        chains.push_back(entryFirstBlock(session.superBlock, resolved.entry));
+    } else if (!recursive) {
+        LOG_ERROR("Is a directory: " << resolved.name << " (use rm -r)");
+        return -1;
+    } else if (!collectSubtree(session, entryFirstBlock(session.superBlock, resolved.entry), path, chains, directories)) {
+        return -1;
+    }
+
+    if (!removeDirectoryEntry(session, resolved.parentBlock, resolved.slot)) {
+        LOG_ERROR("Failed to remove directory entry for: " << resolved.name);
+        return -1;
+    }
+    if (!directories.empty()) {
+        eraseDirectoryDentries(session, directories);
+    }
+    releaseChains(session, chains);
+
+    cout << (directories.empty() ? "File removed successfully." : "Directory tree removed successfully.") << endl;
+    return 0;
+}
+
+int dumpe2fs(FileSystemSession &session) {
+    shared_lock<shared_mutex> lock(session.metadataLock);
+    SuperBlock &superBlock = session.superBlock;
+    cout << "Superblock information:" << endl;
+    cout << "Total blocks: " << superBlock.totalBlocks << endl;
+    cout << "Free blocks: " << superBlock.freeBlocks << endl;
+    cout << "Block size: " << superBlock.blockSize << " bytes" << endl;
+    cout << "Root directory block: " << superBlock.rootDirectory << endl;
+    cout << "First data block: " << superBlock.firstDataBlock << endl;
+    cout << "FAT entry size: " << superBlock.fatEntrySize * 8 << " bits" << endl;
+    cout << "First block numbers: " << ((superBlock.features & SUPERBLOCK_FEATURE_BLOCK_HIGH) ? 32 : 16) << " bits" << endl;
+
+    const uint8_t *free_blocks = session.free_blocks;
+    cout << "Free blocks bitmap (hex):" << endl;
+    for (uint32_t i = 0; i < (superBlock.totalBlocks + 7) / 8; i++) {
+        if (i % 16 == 0) {
+            cout << endl;
+        }
+        cout << hex << setw(2) << setfill('0') << (int)free_blocks[i];
+    }
+    cout << dec << setfill(' ') << endl;
+
+    // End markers are shown as stored, 0xffff in a 16-bit FAT
+    uint32_t entryMask = superBlock.fatEntrySize == 4 ? 0xFFFFFFFF : 0xFFFF;
+    cout << "FAT12 table (non-empty blocks):" << endl;
+    for (uint32_t i = 0; i < superBlock.totalBlocks; i++) {
+        uint32_t next = readFAT12Entry(session, i);
+        if (next != FAT_FREE) {
+            cout << "Block " << i << ": " << hex << (next & entryMask) << dec << endl;
+        }
+    }
+
+    cout << "Root directory entries:" << endl;
+    vector<DirectoryEntry> rootEntries;
+    listDirectory(session, superBlock.rootDirectory, rootEntries);
+    for (const auto &entry : rootEntries) {
+        if (entry.filename[0] != 0) {
+            cout << "Name: " << string(entry.filename, strnlen(entry.filename, sizeof(entry.filename))) << endl;
+            cout << "First block: " << entryFirstBlock(session.superBlock, entry) << endl;
+            cout << "Is directory: " << (entry.attributes.is_directory ? "Yes" : "No") << endl;
+        }
+    }
+
+    return 0;
+}
+
+// Finds the directory entry of the file at path. Reports the match when
+// verbose is set, as readFile always has.
+static int lookupFileEntry(FileSystemSession &session, const string &path, DirectoryEntry &fileEntry, bool verbose) {
+    ResolvedPath resolved;
+    if (resolvePath(session, path, resolved) != 0) {
+        return -1;
+    }
+    if (!resolved.found || resolved.entry.attributes.is_directory) {
+        LOG_ERROR("File not found: " << (resolved.name.empty() ? string_view(path) : resolved.name));
+        return -1;
+    }
+    if (verbose) {
+        cout << "File found: " << resolved.name << endl;
+    }
+    fileEntry = resolved.entry;
+    return 0;
+}
+
+int readFile(FileSystemSession &session, const string &path) {
+    shared_lock<shared_mutex> lock(session.metadataLock);
+    cout << "Reading file: " << path << endl;
+    cout << "From file system: " << session.imagePath << endl;
+
+    SuperBlock &superBlock = session.superBlock;
+
+    DirectoryEntry fileEntry;
+    if (lookupFileEntry(session, path, fileEntry, true) != 0) {
+        return -1;
+    }
+
+    size_t fileSize = fileEntry.file_size;
+    vector<uint8_t> data(fileSize);
+
+    // Walk the FAT first and read each physically contiguous run at once
+    vector<BlockRun> runs;
+    collectChainRuns(session, entryFirstBlock(session.superBlock, fileEntry), fileSize, runs);
+
+    size_t offset = 0;
+    for (const BlockRun &run : runs) {
+        if (offset >= fileSize) {
+            break;
+        }
+        cout << "Reading blocks: " << run.start << "-" << run.start + run.length - 1 << " at offset: " << offset << endl;
+        size_t chunkSize = min(fileSize - offset, (size_t)run.length * superBlock.blockSize);
+        if (!blockCacheRead(session, blockOffset(session, run.start), data.data() + offset, chunkSize)) {
+            LOG_ERROR("Failed to read blocks starting at " << run.start);
+            return -1;
+        }
+        session.dataReadCalls++;
+        session.dataBytesRead += chunkSize;
+        cout << "Read " << chunkSize << " bytes from block " << run.start << endl;
+        cout << "Bytes read: ";
+        for (size_t i = 0; i < chunkSize; ++i) {
+            cout << hex << static_cast<int>(data[offset + i]) << " ";
+        }
+        cout << dec << endl;
+        offset += chunkSize;
+    }
+    session.fileReads++;
+
+    cout << "File content:" << endl;
+    cout.write(reinterpret_cast<const char*>(data.data()), data.size());
+    cout << endl;
+    return 0;
+}
+
+// Reads up to length bytes of the file at path starting at offset, fewer at
+// the end of the file and none past it. The blocks are found through the
+// chain index, so the cost does not grow with the offset.
+int readFileRange(FileSystemSession &session, const string &path, uint64_t offset, uint64_t length, vector<uint8_t> &data) {
+    shared_lock<shared_mutex> lock(session.metadataLock);
+    data.clear();
+    DirectoryEntry fileEntry;
+    if (lookupFileEntry(session, path, fileEntry, false) != 0) {
+        return -1;
+    }
+    if (offset >= fileEntry.file_size || length == 0) {
+        session.fileReads++;
+        return 0;
+    }
+    length = min<uint64_t>(length, fileEntry.file_size - offset);
+    data.resize(length);
+
+    vector<BlockRun> runs;
+    chainRunsInRange(session, fileEntry, offset, length, runs);
+
+    uint64_t done = 0;
+    uint64_t skip = offset & (session.superBlock.blockSize - 1); // Into the first run
+    for (const BlockRun &run : runs) {
+        size_t chunkSize = min<uint64_t>(length - done, ((uint64_t)run.length << session.blockShift) - skip);
+        if (!blockCacheRead(session, blockOffset(session, run.start) + skip, data.data() + done, chunkSize)) {
+            LOG_ERROR("Failed to read blocks starting at " << run.start);
+            return -1;
+        }
+        session.dataReadCalls++;
+        session.dataBytesRead += chunkSize;
+        done += chunkSize;
+        skip = 0;
+    }
+    if (done < length) {
+        LOG_ERROR("Block chain of " << path << " ends before its size");
+        return -1;
+    }
+    session.fileReads++;
+    return 0;
+}
+
+// Writes all length bytes to fd. Returns the number of write calls or -1.
+static long writeAllToFd(int fd, const uint8_t *data, size_t length) {
+    long calls = 0;
+    size_t written = 0;
+    while (written < length) {
+        ssize_t n = write(fd, data + written, length - written);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        written += n;
+        calls++;
+    }
+    return calls;
+}
+
+// Writes length bytes of the image starting at offset to outFd. Uses
+// sendfile from the image fd when possible, the mapping with mmap, and a
+// bounded bounce buffer otherwise. Returns the number of I/O calls or -1.
+static long copyImageRange(ImageStorage &storage, uint64_t offset, size_t length, int outFd, bool trySendfile) {
+    long calls = 0;
+
+    while (trySendfile && length > 0) {
+        off_t position = offset;
+        ssize_t n = sendfile(outFd, storage.fd, &position, length);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            if (calls == 0 && (errno == EINVAL || errno == ENOSYS)) {
+                break; // Not supported for this pair of descriptors
+            }
+            return -1;
+        }
+        calls++;
+        storage.io.reads++;
+        storage.io.bytesRead += n;
+        offset += n;
+        length -= n;
+    }
+
+    uint8_t bounce[64 * 1024];
+    while (length > 0) {
+        const uint8_t *source = storagePointer(storage, offset, length);
+        size_t chunk = source ? length : min(length, sizeof(bounce));
+        if (!source) {
+            if (!storageRead(storage, offset, bounce, chunk)) {
+                return -1;
+            }
+            calls++;
+            source = bounce;
+        } else {
+            storage.io.reads++;
+            storage.io.bytesRead += chunk;
+        }
+        long writes = writeAllToFd(outFd, source, chunk);
+        if (writes < 0) {
+            return -1;
+        }
+        calls += writes;
+        offset += chunk;
+        length -= chunk;
+    }
+    return calls;
+}
+
+// Writes length bytes starting at offset to outFd through the block cache,
+// for ranges whose cached copies are newer than the image. Returns the
+// number of I/O calls or -1.
+static long copyCachedRange(FileSystemSession &session, uint64_t offset, size_t length, int outFd) {
+    long calls = 0;
+    uint64_t readsBefore = session.storage.io.reads;
+    uint8_t bounce[64 * 1024];
+    while (length > 0) {
+        size_t chunk = min(length, sizeof(bounce));
+        if (!blockCacheRead(session, offset, bounce, chunk)) {
+            return -1;
+        }
+        long writes = writeAllToFd(outFd, bounce, chunk);
+        if (writes < 0) {
+            return -1;
+        }
+        calls += writes;
+        offset += chunk;
+        length -= chunk;
+    }
+    return calls + (long)(session.storage.io.reads - readsBefore);
+}
+
+// Streams a file's content to outFd run by run without building the whole
+// file in memory and without any debug output
+int catFile(FileSystemSession &session, const string &path, int outFd) {
+    shared_lock<shared_mutex> lock(session.metadataLock);
+    DirectoryEntry fileEntry;
+    if (lookupFileEntry(session, path, fileEntry, false) != 0) {
+        return -1;
+    }
+
+    struct stat st;
+    bool trySendfile = !session.storage.mapping && fstat(outFd, &st) == 0 &&
+                       (S_ISREG(st.st_mode) || S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode));
+
+    uint32_t blockSize = session.superBlock.blockSize;
+    uint64_t remaining = fileEntry.file_size;
+    vector<BlockRun> runs;
+    collectChainRuns(session, entryFirstBlock(session.superBlock, fileEntry), remaining, runs);
+
+    cout.flush(); // Keep earlier buffered output in front of the content
+    for (const BlockRun &run : runs) {
+        if (remaining == 0) {
+            break;
+        }
+        size_t chunkSize = min<uint64_t>(remaining, (uint64_t)run.length * blockSize);
+        // sendfile and the mapping read the image, so runs with dirty cached
+        // blocks, including journaled ones not yet checkpointed, go through
+        // the cache instead
+        bool cached;
+        {
+            lock_guard<mutex> guard(session.cacheMutex);
+            cached = blockCacheHasDirty(session, run.start, run.length);
+        }
+        uint64_t offset = blockOffset(session, run.start);
+        long calls = cached ? copyCachedRange(session, offset, chunkSize, outFd)
+                            : copyImageRange(session.storage, offset, chunkSize, outFd, trySendfile);
+        if (calls < 0) {
+            LOG_ERROR("Failed to stream blocks starting at " << run.start << ": " << strerror(errno));
+            return -1;
+        }
+        session.dataReadCalls += calls;
+        session.dataBytesRead += chunkSize;
+        remaining -= chunkSize;
+    }
+    session.fileReads++;
+    return 0;
+}
+
+// Runs job(0) .. job(count - 1) on up to session.workerThreads threads, one
+// per core when that is 0, the calling thread included. Returns the number
+// of threads used.
+static size_t parallelFor(const FileSystemSession &session, size_t count, const function<void(size_t)> &job) {
+    size_t threads = session.workerThreads ? session.workerThreads : max(1u, thread::hardware_concurrency());
+    threads = max<size_t>(1, min(threads, count));
+
+    atomic<size_t> next(0);
+    auto worker = [&]() {
+        for (size_t i = next++; i < count; i = next++) {
+            job(i);
+        }
+    };
+    vector<thread> workers;
+    for (size_t t = 1; t < threads; t++) {
+        workers.emplace_back(worker);
+    }
+    worker();
+    for (thread &t : workers) {
+        t.join();
+    }
+    return threads;
+}
+
+// Creates the missing parent directories of a host file
+static bool createHostParents(const string &hostFile) {
+    for (size_t slash = hostFile.find('/', 1); slash != string::npos; slash = hostFile.find('/', slash + 1)) {
+        string parent = hostFile.substr(0, slash);
+        if (::mkdir(parent.c_str(), 0755) != 0 && errno != EEXIST) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static int extractFile(FileSystemSession &session, const ExtractRequest &request) {
+    if (!createHostParents(request.hostFile)) {
+        LOG_ERROR("Failed to create directories for " << request.hostFile << ": " << strerror(errno));
+        return -1;
+    }
+    int outFd = open(request.hostFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (outFd < 0) {
+        LOG_ERROR("Failed to create host file " << request.hostFile << ": " << strerror(errno));
+        return -1;
+    }
+    int result = catFile(session, request.path, outFd);
+    if (close(outFd) != 0) {
+        result = -1;
+    }
+    return result;
+}
+
+// Each worker takes the next file and streams it with catFile(), which holds
+// metadataLock shared, so lookups and data reads of different files overlap.
+// Data is read with pread/sendfile on the shared fd or from the mapping.
+int extractFiles(FileSystemSession &session, const vector<ExtractRequest> &files) {
+    atomic<size_t> failures(0);
+    size_t threads = parallelFor(session, files.size(), [&](size_t i) {
+        if (extractFile(session, files[i]) != 0) {
+            failures++;
+        }
+    });
+
+    LOG_INFO("Extracted " << files.size() - failures << " of " << files.size() << " files on " << threads << " threads");
+    return failures == 0 ? 0 : -1;
+}
+
+// Recreates the directory dirBlock (image path `path`) at hostDir and
+// queues its files, with their sizes, for extraction
+static bool planExport(FileSystemSession &session, uint32_t dirBlock, const string &path, const string &hostDir,
+                       vector<pair<uint32_t, ExtractRequest>> &files, vector<uint32_t> &visited) {
+    if (::mkdir(hostDir.c_str(), 0755) != 0 && errno != EEXIST) {
+        LOG_ERROR("Failed to create host directory " << hostDir << ": " << strerror(errno));
+        return false;
+    }
+    if (find(visited.begin(), visited.end(), dirBlock) != visited.end()) {
+        LOG_ERROR("Directory loop at " << path);
+        return false;
+    }
+    visited.push_back(dirBlock);
+
+    vector<DirectoryEntry> entries;
+    listDirectory(session, dirBlock, entries);
+    bool planned = true;
+    for (const DirectoryEntry &entry : entries) {
+        string name = directoryEntryName(entry);
+        if (name.empty() || name == "." || name == ".." || name.find('/') != string::npos) {
+            LOG_WARN("Skipping " << path << "\\" << name);
+            continue;
+        }
+        string childPath = (path == "\\" ? path : path + "\\") + name;
+        string childHost = hostDir + "/" + name;
+        if (entry.attributes.is_directory) {
+            planned = planExport(session, entryFirstBlock(session.superBlock, entry), childPath, childHost, files, visited) && planned;
+        } else {
+            files.push_back({entry.file_size, {childPath, childHost}});
+        }
+    }
+    return planned;
+}
+
+// Recreates the subtree at path under hostDir. The tree is walked with
+// metadataLock held shared; files are then copied by extractFiles(), one
+// file per worker and one image read per run of consecutive blocks, with
+// the largest files started first.
+int exportTree(FileSystemSession &session, const string &path, const string &hostDir) {
+    vector<pair<uint32_t, ExtractRequest>> files;
+    {
+        shared_lock<shared_mutex> lock(session.metadataLock);
+        ResolvedPath resolved;
+        if (resolvePath(session, path, resolved) != 0) {
+            return -1;
+        }
+        if (!resolved.name.empty() && !resolved.found) {
+            LOG_ERROR("File or directory not found: " << resolved.name);
+            return -1;
+        }
+
+        vector<uint32_t> visited;
+        if (resolved.name.empty() || resolved.entry.attributes.is_directory) {
+            uint32_t dirBlock = resolved.name.empty() ? session.superBlock.rootDirectory : entryFirstBlock(session.superBlock, resolved.entry);
+            if (!planExport(session, dirBlock, resolved.name.empty() ? "\\" : path, hostDir, files, visited)) {
+                return -1;
+            }
+        } else {
+            if (::mkdir(hostDir.c_str(), 0755) != 0 && errno != EEXIST) {
+                LOG_ERROR("Failed to create host directory " << hostDir << ": " << strerror(errno));
+                return -1;
+            }
+            files.push_back({resolved.entry.file_size, {path, hostDir + "/" + string(resolved.name)}});
+        }
+    }
+
+    stable_sort(files.begin(), files.end(), [](const pair<uint32_t, ExtractRequest> &a, const pair<uint32_t, ExtractRequest> &b) {
+        return a.first > b.first;
+    });
+    vector<ExtractRequest> requests;
+    uint64_t bytes = 0;
+    for (const auto &file : files) {
+        requests.push_back(file.second);
+        bytes += file.first;
+    }
+    if (extractFiles(session, requests) != 0) {
+        return -1;
+    }
+    cout << "Exported " << requests.size() << " files (" << bytes << " bytes)" << endl;
+    return 0;
+}
+
+// Walks to the parent directory of a file that is about to be created.
+// Fails if a parent is missing or the name is already taken.
+static int findNewFileParent(FileSystemSession &session, const string &path, uint32_t &parentBlock, string &fileName) {
+    ResolvedPath resolved;
+    if (resolvePath(session, path, resolved) != 0) {
+        return -1;
+    }
+    if (resolved.name.empty()) {
+        LOG_ERROR("Invalid file path: " << path);
+        return -1;
+    }
+    if (resolved.found) {
+        LOG_ERROR("File or directory already exists: " << resolved.name);
+        return -1;
+    }
+
+    parentBlock = resolved.parentBlock;
+    fileName = string(resolved.name);
+    return 0;
+}
+
+// Fills a new file entry with the padded 8.3 name and default attributes
+static void initializeFileEntry(const SuperBlock &superBlock, DirectoryEntry &newFile, const string &filename, uint32_t firstBlock, uint32_t fileSize) {
+    memset(&newFile, 0, sizeof(DirectoryEntry));
+
+    string name, extension;
+    size_t dot_pos = filename.find('.');
+    if (dot_pos != string::npos) {
+        name = filename.substr(0, dot_pos);
+        extension = filename.substr(dot_pos + 1);
+    } else {
+        name = filename;
+        extension = "";
+    }
+
+    // Pad filename and extension
+    name.resize(8, ' ');
+    extension.resize(3, ' ');
+
+    strncpy(newFile.filename, name.c_str(), sizeof(newFile.filename));
+    strncpy(newFile.extension, extension.c_str(), sizeof(newFile.extension));
+
+    newFile.attributes.is_directory = 0;
+    newFile.attributes.read_permission = 1;
+    newFile.attributes.write_permission = 1;
+    newFile.creation_date = {1, 1, 40}; // Date: 01/01/1980
+    newFile.last_modification_date = newFile.creation_date;
+    setEntryFirstBlock(superBlock, newFile, firstBlock);
+    newFile.file_size = fileSize;
+}
+
+// True if name reads back unchanged from the entry it would get, so it is
+// not cut to the 7 characters of a directory or the 8.3 form of a file
+static bool entryNameFits(const string &name, bool isDirectory) {
+    SuperBlock superBlock = {}; // Only the name is compared
+    DirectoryEntry entry;
+    if (isDirectory) {
+        initializeDirectoryEntry(superBlock, entry, name, 0);
+    } else {
+        initializeFileEntry(superBlock, entry, name, 0, 0);
+    }
+    return directoryEntryName(entry) == name;
+}
+
+// Writes data into the given blocks with one write per contiguous extent
+static bool writeBlocks(FileSystemSession &session, const vector<uint32_t> &blocks, const uint8_t *data, size_t size) {
+    uint32_t blockSize = session.superBlock.blockSize;
+    size_t offset = 0;
+    for (size_t b = 0; offset < size;) {
+        size_t runLength = 1;
+        while (b + runLength < blocks.size() && blocks[b + runLength] == blocks[b] + runLength) {
+            runLength++;
+        }
+        size_t chunkSize = min(size - offset, runLength * blockSize);
+        if (!blockCacheWrite(session, blockOffset(session, blocks[b]), data + offset, chunkSize)) {
+            return false;
+        }
+        offset += chunkSize;
+        b += runLength;
+    }
+    return true;
+}
+
+// Links blocks into a chain after tail (if any) and terminates it
+static void linkBlocks(FileSystemSession &session, int tail, const vector<uint32_t> &blocks) {
+    if (tail >= 0 && !blocks.empty()) {
+        setFATEntry(session, tail, blocks[0]);
+    }
+    for (size_t b = 0; b < blocks.size(); b++) {
+        setFATEntry(session, blocks[b], b + 1 < blocks.size() ? blocks[b + 1] : FAT_END);
+    }
+}
+
+// Frees every block of the chain starting at firstBlock
+void releaseChain(FileSystemSession &session, uint32_t firstBlock) {
+    releaseChains(session, {firstBlock});
+}
+
+// Clears the FAT entries of sorted, unique blocks with one dirty range per
+// run of consecutive blocks, split where a range would not fit one journal
+// group. The bitmap bits follow when the open group commits.
+static void freeBlockRuns(FileSystemSession &session, const vector<uint32_t> &blocks) {
+    const SuperBlock &superBlock = session.superBlock;
+    uint32_t entrySize = superBlock.fatEntrySize;
+    uint64_t limit = journalRangeLimit(session);
+    size_t runLimit = limit > 0 ? max<uint64_t>(1, limit / entrySize) : blocks.size();
+    for (size_t start = 0, end; start < blocks.size(); start = end) {
+        for (end = start + 1; end < blocks.size() && end - start < runLimit && blocks[end] == blocks[end - 1] + 1; end++) {
+        }
+        uint32_t first = blocks[start], last = blocks[end - 1];
+        markMetadataDirty(session, superBlock.fatOffset + (uint64_t)first * entrySize, (uint64_t)(last - first + 1) * entrySize);
+        for (size_t b = start; b < end; b++) {
+            storeFATEntry(session, blocks[b], FAT_FREE);
+        }
+    }
+    vector<uint32_t> &pendingFrees = session.journal.pendingFrees;
+    pendingFrees.insert(pendingFrees.end(), blocks.begin(), blocks.end());
+}
+
+// Frees every block of the given chains in one pass. The chains are walked
+// first; then each run of consecutive blocks has its FAT entries cleared and
+// recorded as one range, and the blocks join the open group's pending frees.
+// Blocks shared by chains of a damaged image are freed once.
+void releaseChains(FileSystemSession &session, const vector<uint32_t> &firstBlocks) {
+    const SuperBlock &superBlock = session.superBlock;
+    vector<uint32_t> blocks;
+    for (uint32_t firstBlock : firstBlocks) {
+        eraseChainIndex(session, firstBlock);
+        uint32_t block = firstBlock;
+        for (uint32_t steps = 0; steps < superBlock.totalBlocks; steps++) {
+            if (block < superBlock.firstDataBlock || block >= superBlock.totalBlocks) {
+                break;
+            }
+            blocks.push_back(block);
+            uint32_t next = readFAT12Entry(session, block);
+            if (next == FAT_END || next == FAT_FREE) {
+                break;
+            }
+            block = next;
+        }
+    }
+    sort(blocks.begin(), blocks.end());
+    blocks.erase(unique(blocks.begin(), blocks.end()), blocks.end());
+    freeBlockRuns(session, blocks);
+}
+
+int writeFile(FileSystemSession &session, const string &path, const vector<uint8_t> &data) {
+    unique_lock<shared_mutex> lock(session.metadataLock);
+    SuperBlock &superBlock = session.superBlock;
+
+    uint32_t currentBlock;
+    string filename;
+    if (findNewFileParent(session, path, currentBlock, filename) != 0) {
+        return -1;
+    }
+
+    // Allocate the whole chain up front as contiguous extents
+    uint32_t blockCount = max<size_t>(1, (data.size() + superBlock.blockSize - 1) / superBlock.blockSize);
+    vector<uint32_t> blocks;
+    if (!allocateExtents(session, blockCount, blocks)) {
+        LOG_ERROR("No free blocks available");
+        return -1;
+    }
+    linkBlocks(session, -1, blocks);
+
+    // The data goes first so that a failed write leaves no entry behind
+    if (!writeBlocks(session, blocks, data.data(), data.size())) {
+        LOG_ERROR("Failed to write file data");
+        releaseChain(session, blocks[0]);
+        return -1;
+    }
+
+    DirectoryEntry newFile;
+    initializeFileEntry(session.superBlock, newFile, filename, blocks[0], data.size());
+    if (!addDirectoryEntry(session, currentBlock, newFile)) {
+        releaseChain(session, blocks[0]);
+        return -1;
+    }
+
+    cout << "File written successfully." << endl;
+    return 0;
+}
+
+// Imports a file from a host descriptor. Input is read into a fixed-size
+// buffer; each filled buffer gets its blocks allocated, linked after the
+// current tail and written, so memory use does not depend on the file size.
+// The first buffer is placed as extents like writeFile() places a file and
+// later ones continue after the tail (see allocateAfter()), so the bitmap
+// is searched for a best fit only once. The directory entry is added once
+// the size is known.
+int writeFileFromFd(FileSystemSession &session, const string &path, int inFd) {
+    unique_lock<shared_mutex> lock(session.metadataLock);
+    uint32_t parentBlock;
+    string filename;
+    if (findNewFileParent(session, path, parentBlock, filename) != 0) {
+        return -1;
+    }
+
+    uint32_t blockSize = session.superBlock.blockSize;
+    vector<uint8_t> buffer(STREAM_BUFFER_SIZE);
+    vector<uint32_t> blocks;
+    int firstBlock = -1, tail = -1;
+    uint64_t fileSize = 0;
+    bool endOfInput = false;
+
+    while (!endOfInput) {
+        size_t filled = 0;
+        while (filled < buffer.size()) {
+            ssize_t n = read(inFd, buffer.data() + filled, buffer.size() - filled);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                LOG_ERROR("Failed to read input: " << strerror(errno));
+                if (firstBlock >= 0) {
+                    releaseChain(session, firstBlock);
+                }
+                return -1;
+            }
+            if (n == 0) {
+                endOfInput = true;
+                break;
+            }
+            filled += n;
+        }
+        if (filled == 0 && firstBlock >= 0) {
+            break;
+        }
+        if (fileSize + filled > UINT32_MAX) {
+            LOG_ERROR("File too large");
+            if (firstBlock >= 0) {
+                releaseChain(session, firstBlock);
+            }
+            return -1;
+        }
+
+        uint32_t blockCount = max<size_t>(1, (filled + blockSize - 1) / blockSize);
+        bool allocated = tail < 0 ? allocateExtents(session, blockCount, blocks) : allocateAfter(session, tail, blockCount, blocks);
+        if (!allocated) {
+            LOG_ERROR("No free blocks available");
+            if (firstBlock >= 0) {
+                releaseChain(session, firstBlock);
+            }
+            return -1;
+        }
+        linkBlocks(session, tail, blocks);
+        if (firstBlock < 0) {
+            firstBlock = blocks[0];
+        }
+        tail = blocks.back();
+
+        if (!writeBlocks(session, blocks, buffer.data(), filled)) {
+            LOG_ERROR("Failed to write file data");
+            releaseChain(session, firstBlock);
+            return -1;
+        }
+        fileSize += filled;
+    }
+
+    DirectoryEntry newFile;
+    initializeFileEntry(session.superBlock, newFile, filename, firstBlock, fileSize);
+    if (!addDirectoryEntry(session, parentBlock, newFile)) {
+        releaseChain(session, firstBlock);
+        return -1;
+    }
+
+    cout << "File written successfully." << endl;
+    return 0;
+}
+
+// Opens a host file ("-" for stdin) and streams it into the image
+int writeFileFromHost(FileSystemSession &session, const string &path, const string &hostFile) {
+    int inFd = hostFile == "-" ? STDIN_FILENO : open(hostFile.c_str(), O_RDONLY);
+    if (inFd < 0) {
+        LOG_ERROR("Failed to open input file: " << hostFile);
+        return -1;
+    }
+    int result = writeFileFromFd(session, path, inFd);
+    if (inFd != STDIN_FILENO) {
+        close(inFd);
+    }
+    return result;
+}
+
+// Sets the modification date and time of an entry to the current local time
+static void touchEntry(DirectoryEntry &entry) {
+    time_t now = time(nullptr);
+    struct tm local;
+    localtime_r(&now, &local);
+    entry.last_modification_date.day = local.tm_mday;
+    entry.last_modification_date.month = local.tm_mon + 1;
+    entry.last_modification_date.year = min(max(local.tm_year - 80, 0), 127); // Years since 1980
+    entry.last_modificaton_time.hours = local.tm_hour;
+    entry.last_modificaton_time.minutes = local.tm_min;
+    entry.last_modificaton_time.seconds = local.tm_sec / 2; // Two second resolution
+}
+
+// Writes data into an existing file at offset, or at its end when append is
+// set. The chain is reused and, when the file grows, extended with
+// allocateAfter() from its tail block, which comes from the chain index
+// rather than a walk of the chain.
+// A gap between the old end and offset reads as zeros. The new size and
+// modification time are written back with a single directory entry write.
+static int updateFile(FileSystemSession &session, const string &path, bool append, uint64_t offset, const vector<uint8_t> &data) {
+    unique_lock<shared_mutex> lock(session.metadataLock);
+    ResolvedPath resolved;
+    if (resolvePath(session, path, resolved) != 0) {
+        return -1;
+    }
+    if (!resolved.found || resolved.entry.attributes.is_directory) {
+        LOG_ERROR("File not found: " << (resolved.name.empty() ? string_view(path) : resolved.name));
+        return -1;
+    }
+
+    DirectoryEntry &entry = resolved.entry;
+    uint32_t firstBlock = entryFirstBlock(session.superBlock, entry);
+    uint32_t oldSize = entry.file_size;
+    if (append) {
+        offset = oldSize;
+    }
+    if (data.empty()) {
+        return 0;
+    }
+    // Checked without adding, which would wrap for an offset near 2^64
+    if (data.size() > UINT32_MAX || offset > UINT32_MAX - data.size()) {
+        LOG_ERROR("File too large");
+        return -1;
+    }
+    uint32_t newSize = max<uint64_t>(oldSize, offset + data.size());
+
+    // The tail is the last block of the chain, which holds byte oldSize - 1
+    uint32_t shift = session.blockShift;
+    uint64_t oldBlocks = max<uint64_t>(1, ((uint64_t)oldSize + session.superBlock.blockSize - 1) >> shift);
+    uint64_t newBlocks = max<uint64_t>(1, ((uint64_t)newSize + session.superBlock.blockSize - 1) >> shift);
+    vector<uint32_t> blocks;
+    uint32_t tail = 0;
+    if (newBlocks > oldBlocks) {
+        vector<BlockRun> tailRun;
+        chainRunsInRange(session, entry, (oldBlocks - 1) << shift, 1, tailRun);
+        if (tailRun.empty()) {
+            LOG_ERROR("Block chain of " << path << " ends before its size");
+            return -1;
+        }
+        tail = tailRun[0].start;
+        if (!allocateAfter(session, tail, newBlocks - oldBlocks, blocks)) {
+            LOG_ERROR("No free blocks available");
+            return -1;
+        }
+        linkBlocks(session, tail, blocks);
+    }
+    extendChainIndex(session, firstBlock, oldSize, newSize, blocks);
+
+    // Zeros for the gap past the old end, then the data. The gap is written
+    // one block of zeros at a time, so no buffer grows with it.
+    uint64_t writeStart = min<uint64_t>(offset, oldSize);
+    uint64_t gapLength = offset - writeStart;
+    vector<uint8_t> zeros(min<uint64_t>(gapLength, session.superBlock.blockSize), 0);
+    entry.file_size = newSize;
+    vector<BlockRun> runs;
+    chainRunsInRange(session, entry, writeStart, newSize - writeStart, runs);
+
+    uint64_t done = 0;
+    uint64_t length = offset + data.size() - writeStart;
+    uint64_t skip = writeStart & (session.superBlock.blockSize - 1);
+    for (const BlockRun &run : runs) {
+        if (done >= length) {
+            break;
+        }
+        uint64_t chunkEnd = done + min<uint64_t>(length - done, ((uint64_t)run.length << shift) - skip);
+        uint64_t position = blockOffset(session, run.start) + skip;
+        bool written = true;
+        // The part of this chunk that falls in the gap, then the part from data
+        while (written && done < min(chunkEnd, gapLength)) {
+            uint64_t piece = min<uint64_t>(min(chunkEnd, gapLength) - done, zeros.size());
+            written = blockCacheWrite(session, position, zeros.data(), piece);
+            position += piece;
+            done += written ? piece : 0;
+        }
+        if (written && done < chunkEnd) {
+            written = blockCacheWrite(session, position, data.data() + (done - gapLength), chunkEnd - done);
+            done += written ? chunkEnd - done : 0;
+        }
+        if (!written) {
+            break;
+        }
+        skip = 0;
+    }
+    if (done < length) {
+        LOG_ERROR("Failed to write file data");
+        if (!blocks.empty()) {
+            eraseChainIndex(session, firstBlock);
+            setFATEntry(session, tail, FAT_END);
+            releaseChain(session, blocks[0]);
+        }
+        return -1;
+    }
+
+    touchEntry(entry);
+    if (!writeDirectoryEntry(session, resolved.slot, entry)) {
+        LOG_ERROR("Failed to update directory entry of " << path);
+        return -1;
+    }
+    cout << "File written successfully." << endl;
+    return 0;
+}
+
+int appendFile(FileSystemSession &session, const string &path, const vector<uint8_t> &data) {
+    return updateFile(session, path, true, 0, data);
+}
+
+// Overwrites data.size() bytes at offset like pwrite, growing the file when
+// the write ends past it
+int writeFileAt(FileSystemSession &session, const string &path, uint64_t offset, const vector<uint8_t> &data) {
+    return updateFile(session, path, false, offset, data);
+}
+
+// Host file or directory planned for import
+#define IMPORT_TARGET SIZE_MAX // Parent index of nodes directly under the target
+typedef struct ImportNode {
+    string hostPath;
+    string name;
+    size_t parent; // Index of the parent directory node or IMPORT_TARGET
+    bool isDirectory;
+    uint64_t size;
+    vector<uint32_t> blocks; // Directory block or file chain, planned up front
+    bool failed;
+} ImportNode;
+
+// Appends the contents of hostDir to nodes, each directory before its
+// children. Anything but regular files and directories is skipped. Names
+// that do not fit a directory entry are reported and fail the plan, so
+// nothing is allocated for an import that would truncate them.
+static bool planImport(const string &hostDir, size_t parent, vector<ImportNode> &nodes) {
+    DIR *stream = opendir(hostDir.c_str());
+    if (!stream) {
+        LOG_ERROR("Failed to open host directory " << hostDir << ": " << strerror(errno));
+        return false;
+    }
+    vector<string> names;
+    while (struct dirent *hostEntry = readdir(stream)) {
+        string name = hostEntry->d_name;
+        if (name != "." && name != "..") {
+            names.push_back(name);
+        }
+    }
+    closedir(stream);
+    sort(names.begin(), names.end());
+
+    bool planned = true;
+    for (const string &name : names) {
+        string hostPath = hostDir + "/" + name;
+        struct stat st;
+        if (lstat(hostPath.c_str(), &st) != 0) {
+            LOG_ERROR("Failed to stat " << hostPath << ": " << strerror(errno));
+            planned = false;
+        } else if (name.find('\\') != string::npos || (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode))) {
+            LOG_WARN("Skipping " << hostPath);
+        } else if (S_ISREG(st.st_mode) && (uint64_t)st.st_size > UINT32_MAX) {
+            LOG_ERROR("File too large: " << hostPath);
+            planned = false;
+        } else if (!entryNameFits(name, S_ISDIR(st.st_mode))) {
+            LOG_ERROR("Name does not fit " << (S_ISDIR(st.st_mode) ? "7 characters" : "the 8.3 form") << ": " << hostPath);
+            planned = false;
+        } else {
+            nodes.push_back({hostPath, name, parent, S_ISDIR(st.st_mode), S_ISDIR(st.st_mode) ? 0 : (uint64_t)st.st_size, {}, false});
+            if (nodes.back().isDirectory) {
+                planned = planImport(hostPath, nodes.size() - 1, nodes) && planned;
+            }
+        }
+    }
+    return planned;
+}
+
+// Copies a planned file from the host into its blocks, IMPORT_BUFFER_SIZE
+// bytes per read and write
+static int importFileData(FileSystemSession &session, const ImportNode &node) {
+    int inFd = open(node.hostPath.c_str(), O_RDONLY);
+    if (inFd < 0) {
+        LOG_ERROR("Failed to open input file " << node.hostPath << ": " << strerror(errno));
+        return -1;
+    }
+
+    uint32_t blockSize = session.superBlock.blockSize;
+    vector<uint8_t> buffer(min<uint64_t>(IMPORT_BUFFER_SIZE, node.size));
+    int result = 0;
+    for (uint64_t offset = 0; offset < node.size && result == 0;) {
+        size_t length = min<uint64_t>(buffer.size(), node.size - offset);
+        size_t filled = 0;
+        ssize_t n = 1;
+        while (filled < length && n > 0) {
+            n = pread(inFd, buffer.data() + filled, length - filled, offset + filled);
+            if (n < 0 && errno == EINTR) {
+                n = 1;
+                continue;
+            }
+            filled += max<ssize_t>(n, 0);
+        }
+        if (filled < length) {
+            LOG_ERROR("Failed to read " << node.hostPath << ": " << (n < 0 ? strerror(errno) : "file shrank"));
+            result = -1;
+            break;
+        }
+
+        vector<uint32_t> chunkBlocks(node.blocks.begin() + offset / blockSize,
+                                     node.blocks.begin() + (offset + length + blockSize - 1) / blockSize);
+        if (!writeBlocks(session, chunkBlocks, buffer.data(), length)) {
+            LOG_ERROR("Failed to write file data for " << node.hostPath);
+            result = -1;
+        }
+        offset += length;
+    }
+    close(inFd);
+    return result;
+}
+
+static void releaseBlocks(FileSystemSession &session, const vector<uint32_t> &blocks) {
+    for (uint32_t block : blocks) {
+        releaseBlock(session, block);
+    }
+}
+
+// Adds an entry for a planned node to its parent unless the name is taken
+static bool addImportEntry(FileSystemSession &session, uint32_t parentBlock, const DirectoryEntry &entry) {
+    DirectoryEntry existing;
+    DirectorySlot slot;
+    string name = directoryEntryName(entry);
+    if (findDirectoryEntry(session, parentBlock, name, existing, slot)) {
+        LOG_ERROR("File or directory already exists: " << name);
+        return false;
+    }
+    return addDirectoryEntry(session, parentBlock, entry);
+}
+
+// Imports the tree under hostDir into the directory at path, creating that
+// directory when it does not exist. The whole tree is planned first and its
+// blocks allocated as one set of extents, so files land in walk order on
+// sequential blocks. Host files are read on worker threads and written in
+// IMPORT_BUFFER_SIZE chunks; the FAT, bitmap and directory updates are then
+// committed once.
+int importTree(FileSystemSession &session, const string &hostDir, const string &path) {
+    unique_lock<shared_mutex> lock(session.metadataLock);
+    uint32_t blockSize = session.superBlock.blockSize;
+
+    ResolvedPath resolved;
+    if (resolvePath(session, path, resolved) != 0) {
+        return -1;
+    }
+    if (resolved.found && !resolved.entry.attributes.is_directory) {
+        LOG_ERROR("Not a directory: " << resolved.name);
+        return -1;
+    }
+    bool createTarget = !resolved.name.empty() && !resolved.found;
+    if (createTarget && !entryNameFits(string(resolved.name), true)) {
+        LOG_ERROR("Name does not fit 7 characters: " << resolved.name);
+        return -1;
+    }
+
+    vector<ImportNode> nodes;
+    if (!planImport(hostDir, IMPORT_TARGET, nodes)) {
+        return -1;
+    }
 
-    vector<string> dirs;
-    size_t start = 0, end;
+    // Directories take one block, files one block per blockSize bytes and at least one
+    uint64_t needed = createTarget;
+    for (const ImportNode &node : nodes) {
+        needed += node.isDirectory ? 1 : max<uint64_t>(1, (node.size + blockSize - 1) / blockSize);
+    }
+    vector<uint32_t> blocks;
+    if (!enoughFreeBlocks(session, needed) || !allocateExtents(session, (uint32_t)needed, blocks)) {
+        LOG_ERROR("Not enough free blocks: need " << needed << ", have " << session.freeBlockCount);
+        return -1;
+    }
+    size_t nextBlock = 0;
+    uint32_t targetBlock = resolved.name.empty() ? session.superBlock.rootDirectory : entryFirstBlock(session.superBlock, resolved.entry);
+    if (createTarget) {
+        targetBlock = blocks[nextBlock++];
+    }
+    for (ImportNode &node : nodes) {
+        size_t count = node.isDirectory ? 1 : max<uint64_t>(1, (node.size + blockSize - 1) / blockSize);
+        node.blocks.assign(blocks.begin() + nextBlock, blocks.begin() + nextBlock + count);
+        nextBlock += count;
+    }
+
+    if (createTarget) {
+        DirectoryEntry newDir;
+        initializeDirectoryEntry(session.superBlock, newDir, resolved.name, targetBlock);
+        setFATEntry(session, targetBlock, FAT_END);
+        if (!initializeDirectoryBlock(session, targetBlock, true) || !addDirectoryEntry(session, resolved.parentBlock, newDir)) {
+            releaseBlocks(session, blocks);
+            return -1;
+        }
+    }
+
+    // Directories first, so that every file has its parent in place
+    uint32_t directories = 0, files = 0, failures = 0;
+    uint64_t bytes = 0;
+    auto parentOf = [&](const ImportNode &node) {
+        return node.parent == IMPORT_TARGET ? targetBlock : nodes[node.parent].blocks[0];
+    };
+    for (ImportNode &node : nodes) {
+        if (!node.isDirectory) {
+            continue;
+        }
+        DirectoryEntry newDir;
+        initializeDirectoryEntry(session.superBlock, newDir, node.name, node.blocks[0]);
+        setFATEntry(session, node.blocks[0], FAT_END);
+        node.failed = (node.parent != IMPORT_TARGET && nodes[node.parent].failed) ||
+                      !initializeDirectoryBlock(session, node.blocks[0], true) ||
+                      !addImportEntry(session, parentOf(node), newDir);
+        if (node.failed) {
+            releaseBlocks(session, node.blocks);
+            failures++;
+        } else {
+            directories++;
+        }
+    }
+
+    vector<size_t> pending;
+    for (size_t n = 0; n < nodes.size(); n++) {
+        ImportNode &node = nodes[n];
+        if (node.isDirectory) {
+            continue;
+        }
+        if (node.parent != IMPORT_TARGET && nodes[node.parent].failed) {
+            node.failed = true;
+            releaseBlocks(session, node.blocks);
+            failures++;
+        } else {
+            pending.push_back(n);
+        }
+    }
+    parallelFor(session, pending.size(), [&](size_t p) {
+        ImportNode &node = nodes[pending[p]];
+        node.failed = importFileData(session, node) != 0;
+    });
+
+    for (size_t n : pending) {
+        ImportNode &node = nodes[n];
+        DirectoryEntry newFile;
+        initializeFileEntry(session.superBlock, newFile, node.name, node.blocks[0], node.size);
+        if (!node.failed) {
+            linkBlocks(session, -1, node.blocks);
+            node.failed = !addImportEntry(session, parentOf(node), newFile);
+            if (node.failed) {
+                releaseChain(session, node.blocks[0]);
+            }
+        } else {
+            releaseBlocks(session, node.blocks);
+        }
+        if (node.failed) {
+            failures++;
+        } else {
+            files++;
+            bytes += node.size;
+        }
+    }
+
+    if (commitJournal(session) != 0) {
+        LOG_ERROR("Failed to commit imported metadata");
+        return -1;
+    }
+    cout << "Imported " << files << " files and " << directories << " directories (" << bytes << " bytes)" << endl;
+    if (failures > 0) {
+        LOG_ERROR("Failed to import " << failures << " files or directories");
+        return -1;
+    }
+    return 0;
+}
 
-    if (path[0] == '\\') {
-        start = 1;
+// A file found by defrag, with the block runs of its chain
+typedef struct DefragFile {
+    DirectorySlot slot;
+    DirectoryEntry entry;
+    vector<BlockRun> runs;
+} DefragFile;
+
+// Collects every file below dirBlock with the runs of its chain
+static bool collectDefragFiles(FileSystemSession &session, uint32_t dirBlock, vector<DefragFile> &files,
+                               unordered_set<uint32_t> &directories) {
+    if (!directories.insert(dirBlock).second) {
+        LOG_ERROR("Directory loop at block " << dirBlock);
+        return false;
+    }
+    vector<DirectoryEntry> entries;
+    vector<DirectorySlot> slots;
+    listDirectory(session, dirBlock, entries, &slots);
+    for (size_t e = 0; e < entries.size(); e++) {
+        if (entries[e].attributes.is_directory) {
+            if (!collectDefragFiles(session, entryFirstBlock(session.superBlock, entries[e]), files, directories)) {
+                return false;
+            }
+            continue;
+        }
+        DefragFile file = {slots[e], entries[e], {}};
+        collectChainRuns(session, entryFirstBlock(session.superBlock, entries[e]), entries[e].file_size, file.runs);
+        files.push_back(std::move(file));
+    }
+    return true;
+}
+
+static void printFragmentation(const char *when, const vector<DefragFile> &files) {
+    size_t fragmented = 0, extents = 0;
+    for (const DefragFile &file : files) {
+        fragmented += file.runs.size() > 1;
+        extents += file.runs.size();
+    }
+    cout << "Fragmentation " << when << ": " << files.size() << " files, " << fragmented << " fragmented, "
+         << extents << " extents (" << fixed << setprecision(2) << (files.empty() ? 0.0 : (double)extents / files.size())
+         << defaultfloat << setprecision(6) << " per file)" << endl;
+}
+
+// Smallest free run of at least count blocks, or a zero-length run
+static BlockRun findFreeRun(const FileSystemSession &session, uint32_t count) {
+    vector<BlockRun> runs;
+    collectFreeRuns(session, runs);
+    BlockRun best = {0, 0};
+    for (const BlockRun &run : runs) {
+        if (run.length >= count && (best.length == 0 || run.length < best.length)) {
+            best = run;
+        }
+    }
+    return best;
+}
+
+// Copies a file's blocks into the contiguous run starting at target, in
+// DEFRAG_BUFFER_SIZE pieces: the old runs are read into the buffer and each
+// piece is written with one sequential write
+static bool copyChain(FileSystemSession &session, const vector<BlockRun> &runs, uint32_t target, vector<uint8_t> &buffer) {
+    uint32_t blocksPerPiece = buffer.size() >> session.blockShift;
+    uint32_t filled = 0;
+    for (size_t r = 0; r < runs.size(); r++) {
+        for (uint32_t done = 0; done < runs[r].length;) {
+            uint32_t count = min(runs[r].length - done, blocksPerPiece - filled);
+            if (!blockCacheRead(session, blockOffset(session, runs[r].start + done), buffer.data() + ((uint64_t)filled << session.blockShift),
+                                (uint64_t)count << session.blockShift)) {
+                return false;
+            }
+            done += count;
+            filled += count;
+            if (filled == blocksPerPiece || (r + 1 == runs.size() && done == runs[r].length)) {
+                if (!blockCacheWrite(session, blockOffset(session, target), buffer.data(), (uint64_t)filled << session.blockShift)) {
+                    return false;
+                }
+                target += filled;
+                filled = 0;
+            }
+        }
+    }
+    return true;
+}
+
+// Releases the old chains of relocated files and commits, after which
+// their blocks may be reused. The new chain and the repointed entry are
+// journaled like any other metadata, so a crash leaves each file at either
+// its old or its new location, never pointing at unallocated blocks; the
+// copy not in use may stay allocated until fsck --repair.
+static int commitRelocations(FileSystemSession &session, vector<uint32_t> &oldChains) {
+    releaseChains(session, oldChains);
+    oldChains.clear();
+    return commitJournal(session);
+}
+
+// Moves every fragmented file into a single contiguous free run, most
+// fragmented files first. Each file is copied to its new run, linked there
+// and its directory entry repointed; its old chain is freed with the next
+// commit. A budget other than 0 caps the bytes copied; files that would
+// exceed it are left alone. Directory chains are not moved.
+int defrag(FileSystemSession &session, uint64_t budgetBytes) {
+    unique_lock<shared_mutex> lock(session.metadataLock);
+    vector<DefragFile> files;
+    unordered_set<uint32_t> directories;
+    if (!collectDefragFiles(session, session.superBlock.rootDirectory, files, directories)) {
+        return -1;
+    }
+    printFragmentation("before", files);
+
+    vector<DefragFile *> fragmented;
+    for (DefragFile &file : files) {
+        if (file.runs.size() > 1) {
+            fragmented.push_back(&file);
+        }
     }
-    while ((end = path.find('\\', start)) != string::npos) {
-        string dir = path.substr(start, end - start);
-        if (!dir.empty()) {
-            dirs.push_back(dir);
+    stable_sort(fragmented.begin(), fragmented.end(), [](const DefragFile *a, const DefragFile *b) {
+        return a->runs.size() > b->runs.size();
+    });
+
+    vector<uint8_t> buffer(DEFRAG_BUFFER_SIZE);
+    vector<uint32_t> oldChains;
+    uint64_t copied = 0;
+    size_t relocated = 0, skipped = 0;
+    for (DefragFile *file : fragmented) {
+        uint32_t count = 0;
+        for (const BlockRun &run : file->runs) {
+            count += run.length;
+        }
+        uint64_t bytes = (uint64_t)count << session.blockShift;
+        if (budgetBytes > 0 && copied + bytes > budgetBytes) {
+            skipped++;
+            continue;
+        }
+        BlockRun target = findFreeRun(session, count);
+        if (target.length == 0 && !oldChains.empty()) {
+            if (commitRelocations(session, oldChains) != 0) {
+                return -1;
+            }
+            target = findFreeRun(session, count);
+        }
+        if (target.length == 0) {
+            skipped++;
+            continue;
         }
-        start = end + 1;
-    }
-    if (start < path.size()) {
-        dirs.push_back(path.substr(start));
-    }
 
-    DirectoryEntry fileEntry;
-    bool fileFound = false;
-
-    for (size_t i = 0; i < dirs.size(); ++i) {
-        bool found = false;
-        vector<DirectoryEntry> entries = readDirectoryEntries(file, currentBlock);
-        for (const auto &entry : entries) {
-            string entryName(entry.filename, strnlen(entry.filename, sizeof(entry.filename)));
-            if (entry.extension[0] != ' ') {
-                entryName += "." + string(entry.extension, strnlen(entry.extension, sizeof(entry.extension)));
-            }
-            cout << "Entry: " << entryName << endl;
-            if (entryName == dirs[i]) {
-                if (i == dirs.size() - 1) {
-                    fileEntry = entry;
-                    fileFound = true;
-                    cout << "File found: " << entryName << endl;
-                    found = true;
-                    break;
-                }
-                if (entry.attributes.is_directory) {
-                    currentBlock = entry.first_block_number;
-                    found = true;
-                    break;
-                } else {
-                    cerr << "Not a directory: " << dirs[i] << endl;
-                    return -1;
-                }
-            }
+        vector<uint32_t> blocks(count);
+        for (uint32_t b = 0; b < count; b++) {
+            blocks[b] = target.start + b;
+        }
+        claimBlocks(session, blocks);
+        if (!copyChain(session, file->runs, target.start, buffer)) {
+            LOG_ERROR("Failed to copy blocks of " << directoryEntryName(file->entry));
+            releaseBlocks(session, blocks);
+            commitRelocations(session, oldChains);
+            return -1;
         }
-        if (!found) {
-            cerr << "Directory or file not found: " << dirs[i] << endl;
+        linkBlocks(session, -1, blocks);
+        oldChains.push_back(entryFirstBlock(session.superBlock, file->entry));
+        setEntryFirstBlock(session.superBlock, file->entry, target.start);
+        writeDirectoryEntry(session, file->slot, file->entry);
+        file->runs.assign(1, {target.start, count});
+        copied += bytes;
+        relocated++;
+
+        if (session.journal.pendingBytes > journalCapacity(session) / 2 && commitRelocations(session, oldChains) != 0) {
             return -1;
         }
     }
-
-    if (!fileFound) {
-        cerr << "File not found: " << dirs.back() << endl;
+    if (commitRelocations(session, oldChains) != 0) {
         return -1;
     }
 
-    FAT12Entry fat[MAX_BLOCKS];
-    readFAT12(file, fat);
-
-    uint32_t currentDataBlock = fileEntry.first_block_number;
-    size_t fileSize = fileEntry.file_size;
-    vector<uint8_t> data(fileSize);
-
-    size_t offset = 0;
-    while (offset < fileSize) {
-        cout << "Reading block: " << currentDataBlock << " at offset: " << offset << endl;
-        file.seekg(currentDataBlock * superBlock.blockSize, ios::beg);
-        size_t chunkSize = min(fileSize - offset, (size_t)superBlock.blockSize);
-        file.read(reinterpret_cast<char*>(data.data() + offset), chunkSize);
-        cout << "Read " << chunkSize << " bytes from block " << currentDataBlock << endl;
-        cout << "Bytes read: ";
-        for (size_t i = 0; i < chunkSize; ++i) {
-            cout << hex << static_cast<int>(data[offset + i]) << " ";
-        }
-        cout << endl;
-        offset += chunkSize;
-        currentDataBlock = readFAT12Entry(fat, currentDataBlock);
-        if (currentDataBlock == FAT_END) {
-            break;
-        }
+    cout << "Relocated " << relocated << " files (" << copied << " bytes)";
+    if (skipped > 0) {
+        cout << ", skipped " << skipped;
     }
-
-    file.close();
-    cout << "File content:" << endl;
-    cout.write(reinterpret_cast<const char*>(data.data()), data.size());
     cout << endl;
+    printFragmentation("after", files);
     return 0;
 }
 
-int writeFile(const string &fileSystemFile, const string &path, const vector<uint8_t> &data) {
-    fstream file(fileSystemFile, ios::binary | ios::in | ios::out);
-    if (!file.is_open()) {
-        cerr << "Failed to open file system file: " << fileSystemFile << endl;
-        return -1;
+// A directory queued for the fsck walk
+typedef struct FsckDirectory {
+    uint32_t block;
+    string path;
+} FsckDirectory;
+
+// What fsck found in one directory: its subdirectories, the number of
+// files and the problems of its own chains and those of its files
+typedef struct FsckScan {
+    vector<FsckDirectory> children;
+    uint32_t files;
+    uint32_t crossLinked;
+    uint32_t badBlocks;
+    uint32_t sizeMismatches;
+    vector<uint32_t> unterminated; // Last blocks of chains that end in FAT_FREE
+    vector<string> problems;
+} FsckScan;
+
+// Marks the blocks of a chain in reachable and returns how many there are.
+// A block found already marked is shared with another chain, or the chain
+// loops, and the walk stops there, so it ends within totalBlocks steps.
+// The root directory's first block lies in the reserved region, untracked,
+// and its FAT entry stays FAT_FREE until the root grows past one block.
+static uint32_t markChain(const FileSystemSession &session, uint32_t firstBlock, const string &path,
+                          vector<atomic<uint64_t>> &reachable, FsckScan &scan) {
+    const SuperBlock &superBlock = session.superBlock;
+    uint32_t block = firstBlock;
+    for (uint32_t count = 0;; count++) {
+        bool isRoot = count == 0 && block == superBlock.rootDirectory;
+        if (block >= superBlock.totalBlocks || (block < superBlock.firstDataBlock && !isRoot)) {
+            scan.badBlocks++;
+            scan.problems.push_back(path + ": block " + to_string(block) + " is outside the data region");
+            return count;
+        }
+        uint64_t bit = 1ULL << (block % 64);
+        if (!isRoot && reachable[block / 64].fetch_or(bit) & bit) {
+            scan.crossLinked++;
+            scan.problems.push_back(path + ": block " + to_string(block) + " is cross-linked or loops");
+            return count;
+        }
+        uint32_t next = readFAT12Entry(session, block);
+        if (next == FAT_END || (next == FAT_FREE && isRoot)) {
+            return count + 1;
+        }
+        if (next == FAT_FREE) {
+            scan.unterminated.push_back(block);
+            scan.problems.push_back(path + ": chain ends at block " + to_string(block) + " without FAT_END");
+            return count + 1;
+        }
+        block = next;
     }
+}
 
-    SuperBlock superBlock;
-    readSuperBlock(file, superBlock);
-
-    uint8_t free_blocks[MAX_BLOCKS / 8];
-    readFreeBlocks(file, free_blocks);
-
-    FAT12Entry fat[MAX_BLOCKS];
-    readFAT12(file, fat);
-
-    uint32_t currentBlock = superBlock.rootDirectory;
-
-    vector<string> dirs;
-    size_t start = 0, end;
-
-    if (path[0] == '\\') {
-        start = 1;
+// Marks a directory's own chain, its hash index and the chains of its files
+static void scanFsckDirectory(FileSystemSession &session, const FsckDirectory &directory,
+                              vector<atomic<uint64_t>> &reachable, FsckScan &scan) {
+    markChain(session, directory.block, directory.path, reachable, scan);
+    DirectoryHeader header;
+    if (readDirectoryHeader(session, directory.block, header) && header.indexBlock != 0 &&
+        markChain(session, header.indexBlock, directory.path + " (index)", reachable, scan) != header.indexBlockCount) {
+        scan.sizeMismatches++;
+        scan.problems.push_back(directory.path + ": hash index chain does not have " + to_string(header.indexBlockCount) + " blocks");
     }
-    while ((end = path.find('\\', start)) != string::npos) {
-        string dir = path.substr(start, end - start);
-        if (!dir.empty()) {
-            dirs.push_back(dir);
+
+    vector<DirectoryEntry> entries;
+    listDirectory(session, directory.block, entries);
+    string prefix = directory.path == "\\" ? "" : directory.path;
+    for (const DirectoryEntry &entry : entries) {
+        string path = prefix + "\\" + directoryEntryName(entry);
+        if (entry.attributes.is_directory) {
+            scan.children.push_back({entryFirstBlock(session.superBlock, entry), path});
+            continue;
+        }
+        scan.files++;
+        uint64_t expected = max<uint64_t>(1, ((uint64_t)entry.file_size + session.superBlock.blockSize - 1) >> session.blockShift);
+        size_t problems = scan.problems.size();
+        uint32_t count = markChain(session, entryFirstBlock(session.superBlock, entry), path, reachable, scan);
+        if (count != expected && scan.problems.size() == problems) {
+            scan.sizeMismatches++;
+            scan.problems.push_back(path + ": chain has " + to_string(count) + " blocks, the file size needs " + to_string(expected));
         }
-        start = end + 1;
     }
-    if (start < path.size()) {
-        dirs.push_back(path.substr(start));
+}
+
+// Blocks of one bitmap word that fsck found out of place
+typedef struct FsckWord {
+    uint64_t leaked; // Used in the bitmap or the FAT but on no chain
+    uint64_t lost;   // On a chain but free in the bitmap
+} FsckWord;
+
+// Checks the FAT, the free block bitmap, the directory tree and the free
+// block counter against each other. The directory tree is walked level by
+// level, the directories of a level scanned by parallel workers that mark
+// every chain they follow in a shared bitmap of reachable blocks. That
+// bitmap is then compared 64 blocks at a time with the free block bitmap and
+// the FAT. With repair, leaked blocks are freed, reachable blocks marked
+// free are marked used, chains ending in FAT_FREE get FAT_END and the
+// counter is recomputed, all in one commit. Cross-linked chains, blocks
+// outside the data region and size mismatches are only reported. Returns 0
+// if no problems remain.
+int fsck(FileSystemSession &session, bool repair) {
+    shared_lock<shared_mutex> sharedLock(session.metadataLock, defer_lock);
+    unique_lock<shared_mutex> exclusiveLock(session.metadataLock, defer_lock);
+    if (repair) {
+        exclusiveLock.lock();
+    } else {
+        sharedLock.lock();
+    }
+    const SuperBlock &superBlock = session.superBlock;
+    uint32_t words = bitmapSize(superBlock) / 8;
+    vector<atomic<uint64_t>> reachable(words);
+    for (atomic<uint64_t> &word : reachable) {
+        word.store(0, memory_order_relaxed);
     }
 
-    for (size_t i = 0; i < dirs.size(); ++i) {
-        bool found = false;
-        vector<DirectoryEntry> entries = readDirectoryEntries(file, currentBlock);
-        for (auto &entry : entries) {
-            string entryName(entry.filename, strnlen(entry.filename, sizeof(entry.filename)));
-            if (!string(entry.extension).empty()) {
-                entryName += "." + string(entry.extension, strnlen(entry.extension, sizeof(entry.extension)));
+    FsckScan total = {};
+    size_t directories = 0, threads = 1, loops = 0;
+    unordered_set<uint32_t> visited = {superBlock.rootDirectory};
+    vector<FsckDirectory> level = {{superBlock.rootDirectory, "\\"}};
+    while (!level.empty()) {
+        vector<FsckScan> scans(level.size());
+        threads = max(threads, parallelFor(session, level.size(), [&](size_t d) {
+            scanFsckDirectory(session, level[d], reachable, scans[d]);
+        }));
+        directories += level.size();
+
+        vector<FsckDirectory> next;
+        for (FsckScan &scan : scans) {
+            for (const string &problem : scan.problems) {
+                LOG_WARN(problem);
             }
-            if (entryName == dirs[i]) {
-                if (i == dirs.size() - 1) {
-                    cerr << "File or directory already exists: " << dirs[i] << endl;
-                    return -1;
-                }
-                if (entry.attributes.is_directory) {
-                    currentBlock = entry.first_block_number;
-                    found = true;
-                    break;
+            total.files += scan.files;
+            total.crossLinked += scan.crossLinked;
+            total.badBlocks += scan.badBlocks;
+            total.sizeMismatches += scan.sizeMismatches;
+            total.unterminated.insert(total.unterminated.end(), scan.unterminated.begin(), scan.unterminated.end());
+            for (FsckDirectory &child : scan.children) {
+                if (visited.insert(child.block).second) {
+                    next.push_back(std::move(child));
                 } else {
-                    cerr << "Not a directory: " << dirs[i] << endl;
-                    return -1;
+                    loops++;
+                    LOG_WARN(child.path << ": directory block " << child.block << " is already in the tree");
                 }
             }
         }
-        if (!found) {
-            if (i != dirs.size() - 1) {
-                cerr << "Parent directory not found: " << dirs[i] << endl;
-                return -1;
-            }
+        level.swap(next);
+    }
 
-            int freeBlock = findFreeBlock(fat);
-            if (freeBlock == -1) {
-                cerr << "No free blocks available" << endl;
-                return -1;
+    // Blocks freed in the open group count as free, as they will be once it commits
+    vector<uint64_t> pendingFree(words, 0);
+    for (uint32_t block : session.journal.pendingFrees) {
+        if (block < superBlock.totalBlocks) {
+            pendingFree[block / 64] |= 1ULL << (block % 64);
+        }
+    }
+
+    vector<FsckWord> found(words);
+    size_t tasks = (words + FSCK_WORDS_PER_TASK - 1) / FSCK_WORDS_PER_TASK;
+    parallelFor(session, tasks, [&](size_t task) {
+        uint32_t end = min<uint32_t>(words, (task + 1) * FSCK_WORDS_PER_TASK);
+        for (uint32_t word = task * FSCK_WORDS_PER_TASK; word < end; word++) {
+            uint64_t data = blockRangeMask(word, superBlock.firstDataBlock, superBlock.totalBlocks);
+            uint64_t fatUsed = 0;
+            for (uint64_t bits = data; bits; bits &= bits - 1) {
+                uint32_t bit = __builtin_ctzll(bits);
+                if (readFAT12Entry(session, word * 64 + bit) != FAT_FREE) {
+                    fatUsed |= 1ULL << bit;
+                }
             }
+            uint64_t free = (loadBitmapWord(session.free_blocks, word) | pendingFree[word]) & data;
+            uint64_t marked = reachable[word].load(memory_order_relaxed);
+            found[word].leaked = ((data & ~free) | fatUsed) & ~marked;
+            found[word].lost = marked & free;
+        }
+    });
 
-            fat[freeBlock] = FAT_END;
-            free_blocks[freeBlock / 8] &= ~(1 << (freeBlock % 8));
-            writeFAT12(file, fat);
-            writeFreeBlocks(file, free_blocks);
+    vector<uint32_t> leaked, lost;
+    for (uint32_t word = 0; word < words; word++) {
+        for (uint64_t bits = found[word].leaked; bits; bits &= bits - 1) {
+            leaked.push_back(word * 64 + __builtin_ctzll(bits));
+        }
+        for (uint64_t bits = found[word].lost; bits; bits &= bits - 1) {
+            lost.push_back(word * 64 + __builtin_ctzll(bits));
+        }
+    }
+    uint32_t counted = 0;
+    for (uint32_t word = 0; word < words; word++) {
+        counted += __builtin_popcountll(freeBitsInWord(session.free_blocks, word, superBlock.firstDataBlock, superBlock.totalBlocks));
+    }
+
+    cout << "Checked " << directories << " directories and " << total.files << " files on " << threads << " threads" << endl;
+    cout << "Leaked blocks: " << leaked.size() << endl;
+    cout << "Reachable blocks marked free: " << lost.size() << endl;
+    cout << "Chains without FAT_END: " << total.unterminated.size() << endl;
+    cout << "Cross-linked blocks: " << total.crossLinked << endl;
+    cout << "Blocks outside the data region: " << total.badBlocks << endl;
+    cout << "Chain length mismatches: " << total.sizeMismatches << endl;
+    cout << "Directory loops: " << loops << endl;
+    cout << "Free block counter: " << superBlock.freeBlocks << ", bitmap: " << counted << endl;
+
+    size_t repairable = leaked.size() + lost.size() + total.unterminated.size() + (superBlock.freeBlocks != counted);
+    size_t unrepairable = total.crossLinked + total.badBlocks + total.sizeMismatches + loops;
+    if (repair && repairable > 0) {
+        freeBlockRuns(session, leaked);
+        for (uint32_t block : lost) {
+            setBlockFree(session, block, false);
+        }
+        for (uint32_t block : total.unterminated) {
+            setFATEntry(session, block, FAT_END);
+        }
+        initializeAllocator(session);
+        updateFreeBlockCount(session);
+        if (commitJournal(session) != 0) {
+            return -1;
+        }
+        cout << "Repaired " << repairable << " problems; free blocks: " << session.freeBlockCount << endl;
+        repairable = 0;
+    }
 
-            DirectoryEntry newFile;
-            memset(&newFile, 0, sizeof(DirectoryEntry));
+    if (repairable + unrepairable == 0) {
+        cout << "File system is clean." << endl;
+        return 0;
+    }
+    cout << "File system has " << repairable + unrepairable << " problems"
+         << (repairable > 0 ? " (run with --repair to fix the leaks and counters)" : "") << "." << endl;
+    return -1;
+}
 
-            string filename = dirs[i];
-            string name, extension;
-            size_t dot_pos = filename.find('.');
-            if (dot_pos != string::npos) {
-                name = filename.substr(0, dot_pos);
-                extension = filename.substr(dot_pos + 1);
-            } else {
-                name = filename;
-                extension = "";
-            }
+// Writes all of buffer at offset of a host file
+static bool writeAt(int fd, const void *buffer, size_t length, uint64_t offset) {
+    const uint8_t *in = static_cast<const uint8_t*>(buffer);
+    while (length > 0) {
+        ssize_t n = pwrite(fd, in, length, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        in += n;
+        offset += n;
+        length -= n;
+    }
+    return true;
+}
 
-            // Pad filename and extension
-            name.resize(8, ' ');
-            extension.resize(3, ' ');
-
-            strncpy(newFile.filename, name.c_str(), sizeof(newFile.filename));
-            strncpy(newFile.extension, extension.c_str(), sizeof(newFile.extension));
-
-            newFile.attributes.is_directory = 0;
-            newFile.attributes.read_permission = 1;
-            newFile.attributes.write_permission = 1;
-            newFile.creation_date = {1, 1, 40}; // Date: 01/01/1980
-            newFile.last_modification_date = newFile.creation_date;
-            newFile.first_block_number = freeBlock;
-            newFile.file_size = data.size();
-
-            addDirectoryEntry(file, newFile, currentBlock);
-
-            // Write data to blocks
-            uint32_t currentDataBlock = freeBlock;
-            size_t offset = 0;
-            while (offset < data.size()) {
-                int nextFreeBlock = findFreeBlock(fat);
-                if (nextFreeBlock == -1) {
-                    cerr << "No free blocks available for data" << endl;
-                    return -1;
-                }
+// Writes zeros over [offset, end) of a host file, in FORMAT_ZERO_CHUNK_SIZE
+// writes that start on a chunk boundary after the first
+static bool zeroRange(int fd, uint64_t offset, uint64_t end) {
+    void *chunk = aligned_alloc(FORMAT_ZERO_ALIGNMENT, FORMAT_ZERO_CHUNK_SIZE);
+    if (!chunk) {
+        return false;
+    }
+    memset(chunk, 0, FORMAT_ZERO_CHUNK_SIZE);
+    bool written = true;
+    while (written && offset < end) {
+        uint64_t length = min<uint64_t>(end - offset, FORMAT_ZERO_CHUNK_SIZE - offset % FORMAT_ZERO_CHUNK_SIZE);
+        written = writeAt(fd, chunk, length, offset);
+        offset += length;
+    }
+    free(chunk);
+    return written;
+}
 
-                fat[currentDataBlock] = nextFreeBlock;
-                currentDataBlock = nextFreeBlock;
+// Creates an image of totalBlocks blocks, DEFAULT_IMAGE_SIZE bytes when
+// 0, with an empty root directory
+int makeFileSystem(const string &fileSystemFile, uint32_t blockSize, uint32_t totalBlocks, FormatMode mode) {
+    if (totalBlocks == 0 && blockSize > 0) {
+        totalBlocks = DEFAULT_IMAGE_SIZE / blockSize;
+    }
+    SuperBlock superBlock;
+    if (!initializeSuperBlock(superBlock, blockSize, totalBlocks)) {
+        LOG_ERROR("Unsupported geometry: " << totalBlocks << " blocks of " << blockSize << " bytes");
+        return -1;
+    }
 
-                free_blocks[currentDataBlock / 8] &= ~(1 << (currentDataBlock % 8));
+    // Everything below the first data block is built in one buffer and
+    // written with a single call; the journal in between stays zeroed
+    uint64_t formatSize = (uint64_t)superBlock.firstDataBlock * blockSize;
+    uint64_t imageSize = (uint64_t)superBlock.totalBlocks * blockSize;
+    vector<uint8_t> metadata(formatSize, 0);
+    memcpy(metadata.data(), &superBlock, superBlockSize(superBlock));
+    initializeFreeBlocks(metadata.data() + superBlock.bitmapOffset, superBlock);
+    initializeFAT12(metadata.data() + superBlock.fatOffset, superBlock);
+    initializeRootDirectory(metadata.data() + (uint64_t)superBlock.rootDirectory * blockSize, superBlock);
+
+    int fd = open(fileSystemFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        LOG_ERROR("Failed to create file system file: " << fileSystemFile << ": " << strerror(errno));
+        return -1;
+    }
+    bool created = writeAt(fd, metadata.data(), metadata.size(), 0);
 
-                size_t chunkSize = min(data.size() - offset, (size_t)superBlock.blockSize);
-                file.seekp(currentDataBlock * superBlock.blockSize, ios::beg);
-                file.write(reinterpret_cast<const char*>(data.data() + offset), chunkSize);
-                offset += chunkSize;
-            }
+    // The data blocks are left as a hole, reserved, or written out
+    if (created && mode == FORMAT_ALLOCATE && fallocate(fd, 0, formatSize, imageSize - formatSize) != 0) {
+        LOG_WARN("fallocate failed (" << strerror(errno) << "), leaving the data blocks sparse");
+        mode = FORMAT_SPARSE;
+    }
+    if (created && mode == FORMAT_ZERO) {
+        created = zeroRange(fd, formatSize, imageSize);
+    }
+    if (created && mode == FORMAT_SPARSE) {
+        created = ftruncate(fd, imageSize) == 0;
+    }
+    if (!created) {
+        LOG_ERROR("Failed to write file system file: " << fileSystemFile << ": " << strerror(errno));
+    }
+    if (close(fd) != 0 || !created) {
+        return -1;
+    }
+    LOG_INFO("File system created successfully.");
+    return 0;
+}
 
-            fat[currentDataBlock] = FAT_END;
-            writeFAT12(file, fat);
-            writeFreeBlocks(file, free_blocks);
+// Parses a decimal byte offset or count
+static bool parseByteCount(const string &text, uint64_t &value) {
+    char *end;
+    value = strtoull(text.c_str(), &end, 10);
+    return !text.empty() && isdigit(static_cast<unsigned char>(text[0])) && *end == '\0';
+}
 
-            file.close();
-            cout << "File written successfully." << endl;
-            return 0;
+// Parses the "--offset N [--length M]" options of a ranged read, in either
+// order. Without --length the read runs to the end of the file.
+static bool parseReadRange(const vector<string> &options, uint64_t &offset, uint64_t &length) {
+    offset = 0;
+    length = UINT64_MAX;
+    for (size_t i = 0; i < options.size(); i += 2) {
+        if (i + 1 >= options.size() || (options[i] != "--offset" && options[i] != "--length")) {
+            return false;
+        }
+        if (!parseByteCount(options[i + 1], options[i] == "--offset" ? offset : length)) {
+            return false;
         }
     }
+    return true;
+}
 
-    file.close();
+// Reads a byte range of a file and writes it unmodified to stdout
+static int printFileRange(FileSystemSession &session, const string &path, uint64_t offset, uint64_t length) {
+    vector<uint8_t> data;
+    if (readFileRange(session, path, offset, length, data) != 0) {
+        return -1;
+    }
+    cout.write(reinterpret_cast<const char*>(data.data()), data.size());
+    cout.flush();
     return 0;
 }
 
-int main(int argc, char *argv[]) {
-    if (argc < 3) {
-        cerr << "Usage: " << argv[0] << " <operation> <file_system_file> [block_size/path]" << endl;
-        return 1;
+// Extraction requests that mirror each image path under hostDir. Returns
+// false for paths naming the root or using "." or "..".
+static bool extractRequestsUnder(const string &hostDir, const vector<string> &paths, vector<ExtractRequest> &files) {
+    for (const string &path : paths) {
+        ExtractRequest request = {path, hostDir};
+        size_t position = 0;
+        string_view component;
+        while (nextPathComponent(path, position, component)) {
+            if (component == "." || component == "..") {
+                LOG_ERROR("Invalid path for extraction: " << path);
+                return false;
+            }
+            request.hostFile += '/';
+            request.hostFile.append(component.data(), component.size());
+        }
+        if (request.hostFile.size() == hostDir.size()) {
+            LOG_ERROR("Invalid path for extraction: " << path);
+            return false;
+        }
+        files.push_back(request);
     }
+    return true;
+}
 
-    string operation = argv[1];
-    string fileSystemFile = argv[2];
-
-    if (operation == "makeFileSystem") {
-        if (argc != 4) {
-            cerr << "Usage: " << argv[0] << " makeFileSystem <block_size> <file_system_file>" << endl;
-            return 1;
+// Splits a batch command line into the operation and its arguments. Everything
+// after the path of a write or append command, or after the offset of an
+// overwrite command, is kept verbatim as the file content.
+static vector<string> splitCommandLine(const string &line) {
+    vector<string> tokens;
+    size_t pos = 0;
+    while (pos < line.size()) {
+        while (pos < line.size() && isspace(static_cast<unsigned char>(line[pos]))) {
+            pos++;
+        }
+        if (pos >= line.size()) {
+            break;
+        }
+        if ((tokens.size() == 2 && (tokens[0] == "write" || tokens[0] == "append")) ||
+            (tokens.size() == 3 && tokens[0] == "overwrite")) {
+            tokens.push_back(line.substr(pos));
+            break;
+        }
+        size_t end = pos;
+        while (end < line.size() && !isspace(static_cast<unsigned char>(line[end]))) {
+            end++;
         }
+        tokens.push_back(line.substr(pos, end - pos));
+        pos = end;
+    }
+    return tokens;
+}
 
-        uint32_t blockSize;
-        string blockSizeStr = argv[2];
-        fileSystemFile = argv[3];
+int runBatch(FileSystemSession &session, istream &commands, bool interactive) {
+    int failures = 0;
+    string line;
 
-        if (blockSizeStr == "1") {
-            blockSize = 1024;
-        } else if (blockSizeStr == "0.5") {
-            blockSize = 512;
-        } else {
-            cerr << "Error: Block size must be either 1 or 0.5 KB." << endl;
-            return 1;
+    while (true) {
+        if (interactive) {
+            cout << "fat12> " << flush;
+        }
+        if (!getline(commands, line)) {
+            break;
         }
 
-        ofstream file(fileSystemFile, ios::binary);
-        if (!file.is_open()) {
-            cerr << "Failed to create file system file: " << fileSystemFile << endl;
-            return 1;
+        vector<string> args = splitCommandLine(line);
+        if (args.empty() || args[0][0] == '#') {
+            continue;
         }
 
-        SuperBlock superBlock;
-        initializeSuperBlock(superBlock, blockSize);
-        writeSuperBlock(file, superBlock);
+        const string &operation = args[0];
+        int result = 0;
+        uint64_t offset, length;
 
-        uint8_t free_blocks[MAX_BLOCKS / 8];
-        initializeFreeBlocks(free_blocks);
-        writeFreeBlocks(file, free_blocks);
+        if (operation == "quit" || operation == "exit") {
+            break;
+        }
+        beginOperation(session, operation);
+        if (operation == "sync" && args.size() == 1) {
+            result = syncSession(session);
+        } else if (operation == "stats" && args.size() == 1) {
+            printSessionStats(session);
+        } else if (operation == "stats" && args.size() == 2 && args[1] == "json") {
+            printSessionStatsJson(session);
+        } else if (operation == "dumpe2fs" && args.size() == 1) {
+            result = dumpe2fs(session);
+        } else if (operation == "dir" && args.size() == 2) {
+            dir(session, args[1]);
+        } else if (operation == "mkdir" && args.size() == 2) {
+            result = mkdir(session, args[1]);
+        } else if (operation == "rm" && args.size() == 2) {
+            result = rm(session, args[1], false);
+        } else if (operation == "rm" && args.size() == 3 && args[1] == "-r") {
+            result = rm(session, args[2], true);
+        } else if (operation == "fsck" && args.size() == 1) {
+            result = fsck(session, false);
+        } else if (operation == "fsck" && args.size() == 2 && args[1] == "--repair") {
+            result = fsck(session, true);
+        } else if (operation == "defrag" && args.size() == 1) {
+            result = defrag(session, 0);
+        } else if (operation == "defrag" && args.size() == 3 && args[1] == "--budget" && parseByteCount(args[2], length)) {
+            result = defrag(session, length);
+        } else if (operation == "rmdir" && args.size() == 2) {
+            result = rmdir(session, args[1]);
+        } else if (operation == "read" && args.size() == 2) {
+            result = readFile(session, args[1]);
+        } else if (operation == "read" && args.size() > 2 &&
+                   parseReadRange(vector<string>(args.begin() + 2, args.end()), offset, length)) {
+            result = printFileRange(session, args[1], offset, length);
+        } else if (operation == "cat" && args.size() == 2) {
+            result = catFile(session, args[1], STDOUT_FILENO);
+        } else if (operation == "import" && args.size() == 3) {
+            result = importTree(session, args[1], args[2]);
+        } else if (operation == "export" && args.size() == 3) {
+            result = exportTree(session, args[1], args[2]);
+        } else if (operation == "readmany" && args.size() >= 3) {
+            vector<ExtractRequest> files;
+            result = extractRequestsUnder(args[1], vector<string>(args.begin() + 2, args.end()), files) ? extractFiles(session, files) : -1;
+        } else if (operation == "write" && args.size() == 3 && args[2].compare(0, 7, "--from ") == 0) {
+            result = writeFileFromHost(session, args[1], args[2].substr(7));
+        } else if (operation == "write" && args.size() == 3) {
+            vector<uint8_t> data(args[2].begin(), args[2].end());
+            result = writeFile(session, args[1], data);
+        } else if (operation == "append" && args.size() == 3) {
+            result = appendFile(session, args[1], vector<uint8_t>(args[2].begin(), args[2].end()));
+        } else if (operation == "overwrite" && args.size() == 4 && parseByteCount(args[2], offset)) {
+            result = writeFileAt(session, args[1], offset, vector<uint8_t>(args[3].begin(), args[3].end()));
+        } else if (operation == "chmod" && args.size() == 4) {
+            result = chmod(session, args[1], args[2][0] == '1', args[3][0] == '1');
+        } else if (operation == "addpw" && args.size() == 3) {
+            result = addpw(session, args[1], args[2]);
+        } else {
+            LOG_ERROR("Invalid command: " << line);
+            session.currentOperation = "invalid";
+            result = -1;
+        }
 
-        FAT12Entry fat[MAX_BLOCKS];
-        initializeFAT12(fat);
-        writeFAT12(file, fat);
+        if (completeOperation(session, result) != 0) {
+            result = -1;
+        }
+        if (result != 0) {
+            LOG_ERROR("Command failed: " << line);
+            failures++;
+        }
+    }
 
-        initializeRootDirectory(file, superBlock);
+    return failures == 0 ? 0 : -1;
+}
 
-        file.seekp(4 * 1024 * 1024 - 1, ios::beg);
-        file.write("", 1);
+#ifndef FAT12_NO_MAIN
+// Runs one command-line operation against the session opened by main()
+static int runOperation(FileSystemSession &session, int argc, char *argv[]) {
+    string operation = argv[1];
 
-        file.close();
-        cerr << "File system created successfully." << endl;
-    } else if (operation == "dir") {
+    if (operation == "dir") {
         if (argc != 4) {
             cerr << "Usage: " << argv[0] << " dir <file_system_file> <path>" << endl;
             return 1;
         }
         string path = argv[3];
-        dir(fileSystemFile, path);
+        dir(session, path);
     } else if (operation == "mkdir") {
         if (argc != 4) {
             cerr << "Usage: " << argv[0] << " mkdir <file_system_file> <path>" << endl;
             return 1;
         }
         string path = argv[3];
-        if (mkdir(fileSystemFile, path) != 0) {
+        if (mkdir(session, path) != 0) {
             cerr << "Failed to create directory." << endl;
         }
     } else if (operation == "rmdir") {
@@ -1049,41 +4295,173 @@ int main(int argc, char *argv[]) {
             return 1;
         }
         string path = argv[3];
-        if (rmdir(fileSystemFile, path) == 0) {
+        if (rmdir(session, path) == 0) {
             cerr << "Directory removed successfully." << endl;
         } else {
             cerr << "Failed to remove directory." << endl;
         }
+    } else if (operation == "fsck") {
+        bool repair = argc == 4 && string(argv[3]) == "--repair";
+        if (argc != 3 && !repair) {
+            cerr << "Usage: " << argv[0] << " fsck <file_system_file> [--repair]" << endl;
+            return 1;
+        }
+        if (fsck(session, repair) != 0) {
+            return 1;
+        }
+    } else if (operation == "defrag") {
+        uint64_t budget = 0;
+        if (argc != 3 && (argc != 5 || string(argv[3]) != "--budget" || !parseByteCount(argv[4], budget))) {
+            cerr << "Usage: " << argv[0] << " defrag <file_system_file> [--budget bytes]" << endl;
+            return 1;
+        }
+        if (defrag(session, budget) != 0) {
+            cerr << "Failed to defragment." << endl;
+            return 1;
+        }
+    } else if (operation == "rm") {
+        bool recursive = argc == 5 && string(argv[3]) == "-r";
+        if (argc != 4 && !recursive) {
+            cerr << "Usage: " << argv[0] << " rm <file_system_file> [-r] <path>" << endl;
+            return 1;
+        }
+        if (rm(session, argv[argc - 1], recursive) != 0) {
+            cerr << "Failed to remove " << argv[argc - 1] << "." << endl;
+            return 1;
+        }
     } else if (operation == "dumpe2fs") {
         if (argc != 3) {
             cerr << "Usage: " << argv[0] << " dumpe2fs <file_system_file>" << endl;
             return 1;
         }
-        if (dumpe2fs(fileSystemFile) != 0) {
+        if (dumpe2fs(session) != 0) {
             cerr << "Failed to dump file system information." << endl;
         } 
     } else if (operation == "read") {
+        uint64_t offset, length;
+        if (argc < 4 || !parseReadRange(vector<string>(argv + 4, argv + argc), offset, length)) {
+            cerr << "Usage: " << argv[0] << " read <file_system_file> <path> [--offset bytes] [--length bytes]" << endl;
+            return 1;
+        }
+        string path = argv[3];
+        if (argc == 4) {
+            if (readFile(session, path) != 0) {
+                cerr << "Failed to read file." << endl;
+            }
+        } else if (printFileRange(session, path, offset, length) != 0) {
+            cerr << "Failed to read file." << endl;
+            return 1;
+        }
+    } else if (operation == "cat") {
         if (argc != 4) {
-            cerr << "Usage: " << argv[0] << " read <file_system_file> <path>" << endl;
+            cerr << "Usage: " << argv[0] << " cat <file_system_file> <path>" << endl;
             return 1;
         }
         string path = argv[3];
-        if (readFile(fileSystemFile, path) != 0) {
+        if (catFile(session, path, STDOUT_FILENO) != 0) {
             cerr << "Failed to read file." << endl;
+            return 1;
+        }
+    } else if (operation == "import") {
+        if (argc != 5) {
+            cerr << "Usage: " << argv[0] << " import <file_system_file> <host_dir> <path>" << endl;
+            return 1;
+        }
+        if (importTree(session, argv[3], argv[4]) != 0) {
+            cerr << "Failed to import directory tree." << endl;
+            return 1;
+        }
+    } else if (operation == "export") {
+        if (argc != 5) {
+            cerr << "Usage: " << argv[0] << " export <file_system_file> <path> <host_dir>" << endl;
+            return 1;
+        }
+        if (exportTree(session, argv[3], argv[4]) != 0) {
+            cerr << "Failed to export directory tree." << endl;
+            return 1;
+        }
+    } else if (operation == "readmany") {
+        if (argc < 5) {
+            cerr << "Usage: " << argv[0] << " readmany <file_system_file> <host_dir> <path...|->" << endl;
+            return 1;
+        }
+        vector<string> paths(argv + 4, argv + argc);
+        if (argc == 5 && paths[0] == "-") {
+            paths.clear();
+            string line;
+            while (getline(cin, line)) {
+                if (!line.empty()) {
+                    paths.push_back(line);
+                }
+            }
+        }
+        vector<ExtractRequest> files;
+        if (!extractRequestsUnder(argv[3], paths, files) || extractFiles(session, files) != 0) {
+            cerr << "Failed to extract files." << endl;
+            return 1;
+        }
+    } else if (operation == "write" && argc == 6 && string(argv[4]) == "--from") {
+        string path = argv[3];
+        if (writeFileFromHost(session, path, argv[5]) != 0) {
+            cerr << "Failed to write file." << endl;
+            return 1;
         }
     } else if (operation == "write") {
         if (argc != 5) {
             cerr << "Usage: " << argv[0] << " write <file_system_file> <path> <data>" << endl;
+            cerr << "       " << argv[0] << " write <file_system_file> <path> --from <host_file|->" << endl;
             return 1;
         }
         string path = argv[3];
         string data_str = argv[4];
         vector<uint8_t> data(data_str.begin(), data_str.end());
-        if (writeFile(fileSystemFile, path, data) != 0) {
+        if (writeFile(session, path, data) != 0) {
             cerr << "Failed to write file." << endl;
         }
         cout << "File written successfully." << endl;
-    }  else if (operation == "chmod") {
+    } else if (operation == "append") {
+        if (argc != 5) {
+            cerr << "Usage: " << argv[0] << " append <file_system_file> <path> <data>" << endl;
+            return 1;
+        }
+        string data_str = argv[4];
+        if (appendFile(session, argv[3], vector<uint8_t>(data_str.begin(), data_str.end())) != 0) {
+            cerr << "Failed to write file." << endl;
+            return 1;
+        }
+    } else if (operation == "overwrite") {
+        uint64_t offset;
+        if (argc != 6 || !parseByteCount(argv[4], offset)) {
+            cerr << "Usage: " << argv[0] << " overwrite <file_system_file> <path> <offset> <data>" << endl;
+            return 1;
+        }
+        string data_str = argv[5];
+        if (writeFileAt(session, argv[3], offset, vector<uint8_t>(data_str.begin(), data_str.end())) != 0) {
+            cerr << "Failed to write file." << endl;
+            return 1;
+        }
+    } else if (operation == "batch" || operation == "shell") {
+        if ((operation == "batch" && argc != 4) || (operation == "shell" && argc != 3)) {
+            cerr << "Usage: " << argv[0] << " batch <file_system_file> <script|->" << endl;
+            cerr << "       " << argv[0] << " shell <file_system_file>" << endl;
+            return 1;
+        }
+
+        int result;
+        if (operation == "shell" || string(argv[3]) == "-") {
+            result = runBatch(session, cin, operation == "shell");
+        } else {
+            ifstream script(argv[3]);
+            if (!script.is_open()) {
+                cerr << "Failed to open batch script: " << argv[3] << endl;
+                return 1;
+            }
+            result = runBatch(session, script, false);
+        }
+        if (result != 0) {
+            return 1;
+        }
+    } else if (operation == "chmod") {
         if (argc != 6) {
             cerr << "Usage: " << argv[0] << " chmod <file_system_file> <path> <read_permission> <write_permission>" << endl;
             return 1;
@@ -1091,7 +4469,7 @@ int main(int argc, char *argv[]) {
         string path = argv[3];
         bool readPermission = (argv[4][0] == '1');
         bool writePermission = (argv[5][0] == '1');
-        if (chmod(fileSystemFile, path, readPermission, writePermission) != 0) {
+        if (chmod(session, path, readPermission, writePermission) != 0) {
             cerr << "Failed to change permissions." << endl;
             return 1;
         }
@@ -1103,7 +4481,7 @@ int main(int argc, char *argv[]) {
         }
         string path = argv[3];
         string password = argv[4];
-        if (addpw(fileSystemFile, path, password) != 0) {
+        if (addpw(session, path, password) != 0) {
             cerr << "Failed to add/change password." << endl;
             return 1;
         }
@@ -1114,4 +4492,147 @@ int main(int argc, char *argv[]) {
     }
 
     return 0;
-}
\ No newline at end of file
+}
+int main(int argc, char *argv[]) {
+    // Global options precede the operation
+    StorageBackend backend = STORAGE_MMAP;
+    size_t cacheBytes = BLOCK_CACHE_DEFAULT_BYTES;
+    bool printStats = false, statsJson = false;
+    unsigned threads = 0;
+    int optionCount = 0;
+    while (optionCount + 1 < argc && strncmp(argv[optionCount + 1], "--", 2) == 0) {
+        string option = argv[optionCount + 1];
+        if (option == "--backend" && optionCount + 2 < argc) {
+            string name = argv[optionCount + 2];
+            if (name == "mmap") {
+                backend = STORAGE_MMAP;
+            } else if (name == "pread") {
+                backend = STORAGE_PREAD;
+            } else {
+                cerr << "Error: Backend must be either mmap or pread." << endl;
+                return 1;
+            }
+            optionCount += 2;
+        } else if (option == "--cache-size" && optionCount + 2 < argc) {
+            char *end;
+            cacheBytes = strtoull(argv[optionCount + 2], &end, 10);
+            if (*end != '\0') {
+                cerr << "Error: Cache size must be a number of bytes." << endl;
+                return 1;
+            }
+            optionCount += 2;
+        } else if (option == "--threads" && optionCount + 2 < argc) {
+            char *end;
+            threads = strtoul(argv[optionCount + 2], &end, 10);
+            if (*end != '\0') {
+                cerr << "Error: Thread count must be a number." << endl;
+                return 1;
+            }
+            optionCount += 2;
+        } else if (option == "--stats" || option == "--stats=json") {
+            printStats = true;
+            statsJson = option == "--stats=json";
+            optionCount += 1;
+        } else if (option == "--log-level" && optionCount + 2 < argc) {
+            string name = argv[optionCount + 2];
+            if (name == "error") {
+                logLevel = LOG_LEVEL_ERROR;
+            } else if (name == "warn") {
+                logLevel = LOG_LEVEL_WARN;
+            } else if (name == "info") {
+                logLevel = LOG_LEVEL_INFO;
+            } else if (name == "debug") {
+                logLevel = LOG_LEVEL_DEBUG;
+            } else {
+                cerr << "Error: Log level must be one of error, warn, info or debug." << endl;
+                return 1;
+            }
+            optionCount += 2;
+        } else {
+            cerr << "Invalid option: " << option << endl;
+            return 1;
+        }
+    }
+    argv[optionCount] = argv[0];
+    argv += optionCount;
+    argc -= optionCount;
+
+    if (argc < 3) {
+        cerr << "Usage: " << argv[0] << " [--backend mmap|pread] [--cache-size bytes] [--threads n] [--stats[=json]] [--log-level level] <operation> <file_system_file> [block_size/path]" << endl;
+        return 1;
+    }
+
+    string operation = argv[1];
+    string fileSystemFile = argv[2];
+
+    if (operation == "makeFileSystem") {
+        if (argc < 4 || argc > 6) {
+            cerr << "Usage: " << argv[0] << " makeFileSystem <block_size> <file_system_file> [total_blocks] [--allocate|--zero]" << endl;
+            return 1;
+        }
+
+        uint32_t blockSize;
+        string blockSizeStr = argv[2];
+        fileSystemFile = argv[3];
+
+        if (blockSizeStr == "4") {
+            blockSize = 4096;
+        } else if (blockSizeStr == "2") {
+            blockSize = 2048;
+        } else if (blockSizeStr == "1") {
+            blockSize = 1024;
+        } else if (blockSizeStr == "0.5") {
+            blockSize = 512;
+        } else {
+            cerr << "Error: Block size must be one of 0.5, 1, 2 or 4 KB." << endl;
+            return 1;
+        }
+
+        // Data blocks stay sparse unless --allocate reserves them or --zero writes them
+        uint32_t totalBlocks = 0;
+        FormatMode mode = FORMAT_SPARSE;
+        for (int i = 4; i < argc; i++) {
+            string argument = argv[i];
+            if (argument == "--allocate" || argument == "--zero") {
+                mode = argument == "--zero" ? FORMAT_ZERO : FORMAT_ALLOCATE;
+                continue;
+            }
+            char *end;
+            totalBlocks = strtoul(argv[i], &end, 10);
+            if (*end != '\0' || totalBlocks == 0) {
+                cerr << "Error: Total blocks must be a positive number." << endl;
+                return 1;
+            }
+        }
+
+        return makeFileSystem(fileSystemFile, blockSize, totalBlocks, mode) == 0 ? 0 : 1;
+    }
+
+    FileSystemSession session;
+    if (!openSession(session, fileSystemFile, backend, cacheBytes)) {
+        return 1;
+    }
+    session.workerThreads = threads;
+    // Batch and shell record each of their commands themselves
+    bool batch = operation == "batch" || operation == "shell";
+    if (!batch) {
+        beginOperation(session, operation);
+    }
+    int result = runOperation(session, argc, argv);
+    if (!batch) {
+        completeOperation(session, result);
+    }
+    int closed = closeSession(session);
+    if (printStats) {
+        if (statsJson) {
+            printSessionStatsJson(session, cerr);
+        } else {
+            printSessionStats(session, cerr);
+        }
+    }
+    if (closed != 0) {
+        return 1;
+    }
+    return result;
+}
+#endif // FAT12_NO_MAIN
@@ -1,29 +1,127 @@
 #ifndef FAT12_FILE_SYSTEM_H
 #define FAT12_FILE_SYSTEM_H
 
+#include <atomic>
+#include <chrono>
 #include <cstdint>
+#include <iostream>
 #include <string>
 #include <fstream>
+#include <istream>
+#include <list>
+#include <map>
+#include <mutex>
+#include <shared_mutex>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
 
 using namespace std;
 
 // Constants
-#define MAX_BLOCKS 4096
 #define BLOCK_SIZE_512 512
 #define BLOCK_SIZE_1024 1024
+#define BLOCK_SIZE_2048 2048
+#define BLOCK_SIZE_4096 4096
+#define DEFAULT_IMAGE_SIZE (4 * 1024 * 1024)
+#define MAX_TOTAL_BLOCKS (1 << 23)
+#define MAX_IMAGE_SIZE (4ULL << 30) // Journal records address the image with 32-bit offsets
+#define STREAM_BUFFER_SIZE (64 * 1024) // Bounded buffer for streaming imports
+#define IMPORT_BUFFER_SIZE (1024 * 1024) // Per thread buffer of tree imports, a multiple of the block size
+#define FSCK_WORDS_PER_TASK 4096 // Bitmap words, 64 blocks each, cross-checked per fsck task
+#define DEFRAG_BUFFER_SIZE (1024 * 1024) // Copy buffer of defrag, a multiple of the block size
+#define FORMAT_ZERO_CHUNK_SIZE (4 * 1024 * 1024) // Write size of makeFileSystem with FORMAT_ZERO
+#define FORMAT_ZERO_ALIGNMENT 4096
 
-// SuperBlock structure
+// Leveled logging to stderr. Messages above logLevel are skipped without
+// being formatted, and levels above FAT12_LOG_MAX_LEVEL are compiled out.
+typedef enum LogLevel {
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_DEBUG
+} LogLevel;
+
+#ifndef FAT12_LOG_MAX_LEVEL
+#define FAT12_LOG_MAX_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+extern LogLevel logLevel;
+
+#define FAT12_LOG(level, message) \
+    do { \
+        if ((level) <= FAT12_LOG_MAX_LEVEL && (level) <= logLevel) { \
+            std::cerr << message << std::endl; \
+        } \
+    } while (0)
+#define LOG_ERROR(message) FAT12_LOG(LOG_LEVEL_ERROR, message)
+#define LOG_WARN(message) FAT12_LOG(LOG_LEVEL_WARN, message)
+#define LOG_INFO(message) FAT12_LOG(LOG_LEVEL_INFO, message)
+#define LOG_DEBUG(message) FAT12_LOG(LOG_LEVEL_DEBUG, message)
+
+// SuperBlock structure. The geometry fields after firstDataBlock are chosen
+// by makeFileSystem(); the metadata region holds the superblock, the free
+// block bitmap (one bit per block, 1 = free) and the FAT, and is followed
+// by the journal and the root directory block.
+// Images made before the geometry fields existed end the superblock after
+// firstDataBlock; they are read with the fixed LEGACY_* layout and keep
+// magic 0 in memory.
+// features holds SUPERBLOCK_FEATURE_* flags; it sits in what used to be the
+// padding before the bitmap, so images made before it existed read 0.
+#define SUPERBLOCK_MAGIC 0x32315446 // "FT12"
+#define SUPERBLOCK_FEATURE_BLOCK_HIGH 0x00000001 // Directory entries use first_block_high
 typedef struct SuperBlock {
     uint32_t totalBlocks;
     uint32_t freeBlocks;
     uint32_t blockSize;
     uint32_t rootDirectory;
     uint32_t firstDataBlock;
+    uint32_t magic;
+    uint32_t fatEntrySize;  // 2 or 4 bytes
+    uint32_t bitmapOffset;  // Padded to whole 64-bit words
+    uint32_t fatOffset;
+    uint32_t metadataSize;  // End of the FAT
+    uint32_t journalOffset; // The journal runs up to the root directory block
+    uint32_t features;
 } SuperBlock;
 
-typedef uint16_t FAT12Entry;
-#define FAT_FREE 0x0000
-#define FAT_END  0xFFFF
+#define LEGACY_SUPERBLOCK_SIZE 20
+#define LEGACY_TOTAL_BLOCKS 4096
+#define LEGACY_BITMAP_OFFSET LEGACY_SUPERBLOCK_SIZE
+#define LEGACY_FAT_OFFSET (LEGACY_BITMAP_OFFSET + LEGACY_TOTAL_BLOCKS / 8)
+#define LEGACY_METADATA_SIZE (LEGACY_FAT_OFFSET + LEGACY_TOTAL_BLOCKS * 2)
+
+// Value of a FAT entry. Volumes of up to FAT16_MAX_BLOCKS blocks store
+// entries in 16 bits with FAT16_END as the end marker, larger ones in 32.
+typedef uint32_t FAT12Entry;
+#define FAT_FREE 0x00000000
+#define FAT_END  0xFFFFFFFF
+#define FAT16_END 0xFFFF
+#define FAT16_MAX_BLOCKS 0xFFF0
+
+#define METADATA_SECTOR_SIZE 512
+
+// Metadata journal in the reserved blocks between the metadata region and
+// the root directory: a JournalHeader followed by `length` bytes of
+// JournalRecords, each followed by its data unless it is a zero fill.
+// A header with JOURNAL_MAGIC and a matching checksum is a committed group
+// whose records are replayed when the image is opened.
+#define JOURNAL_SIZE (16 * 1024) // Journal bytes reserved by makeFileSystem()
+#define JOURNAL_MAGIC 0x4C4E4A46 // "FJNL"
+#define JOURNAL_RECORD_ZERO 0x0001
+#define JOURNAL_GROUP_OPERATIONS 64 // Operations per group commit at most
+typedef struct JournalHeader {
+    uint32_t magic;
+    uint32_t sequence;
+    uint32_t length;   // Bytes of records after the header
+    uint32_t checksum; // FNV-1a over sequence, length and the records
+} JournalHeader;
+
+typedef struct JournalRecord {
+    uint32_t offset; // Image offset the data belongs at
+    uint16_t length;
+    uint16_t flags;
+} JournalRecord;
 
 // File attributes
 typedef struct file_attributes {
@@ -54,7 +152,8 @@ typedef struct DirectoryEntry {
     char filename[8]; // 64 bits for the filename (8 characters with 8 bits each)
     char extension[3]; // File extension
     file_attributes attributes; // File attributes
-    char reserved[18]; // Extended filename (if it exceeds 8 characters)
+    char reserved[16]; // Extended filename (if it exceeds 8 characters)
+    uint16_t first_block_high; // Upper half of the first block number, see SUPERBLOCK_FEATURE_BLOCK_HIGH
     file_time last_modificaton_time; // Time of last modification
     file_date last_modification_date; // Date of last modification
     file_time creation_time; // Time of creation
@@ -63,25 +162,396 @@ typedef struct DirectoryEntry {
     uint32_t file_size; // Size of the file in bytes
     char password[16]; // Password for the file
 } DirectoryEntry;
+static_assert(sizeof(DirectoryEntry) == 68, "Directory entries are 68 bytes on disk");
+
+// Constants of one supported block size, so that code instantiated for it
+// works with constant strides and shifts instead of superBlock.blockSize
+template <uint32_t BlockSize>
+struct BlockGeometry {
+    static_assert(BlockSize >= BLOCK_SIZE_512 && BlockSize <= BLOCK_SIZE_4096 && (BlockSize & (BlockSize - 1)) == 0,
+                  "Block sizes are powers of two from 512 to 4096 bytes");
+    static constexpr uint32_t size = BlockSize;
+    static constexpr uint32_t shift = __builtin_ctz(BlockSize);
+    static constexpr uint32_t entriesPerBlock = BlockSize / sizeof(DirectoryEntry); // Directory entries per block
+};
+
+// Directories are FAT chains of blocks holding blockSize / sizeof(DirectoryEntry)
+// entries each. Slot 0 of a directory's first block holds this header instead
+// of an entry; its first byte overlays filename[0]. Directories without the
+// header (older images) are still read and grown, but are searched linearly.
+#define DIRECTORY_HEADER_MARK 0x01
+typedef struct DirectoryHeader {
+    uint8_t mark;             // DIRECTORY_HEADER_MARK
+    uint8_t reserved[3];
+    uint32_t entryCount;      // Live entries in the directory
+    uint32_t freeSlots;       // Cleared slots that can be reused before appending
+    uint32_t tailBlock;       // Last block of the directory chain
+    uint32_t tailUsed;        // Slots handed out in tailBlock
+    uint32_t indexBlock;      // First block of the hash index, 0 if there is none
+    uint32_t indexBlockCount; // The index occupies one contiguous run of blocks
+    uint32_t bucketCount;     // Power of two
+    uint32_t usedBuckets;     // Buckets holding a slot or a tombstone
+} DirectoryHeader;
+static_assert(sizeof(DirectoryHeader) <= sizeof(DirectoryEntry), "Directory header must fit in one slot");
+
+// Hash index buckets are open-addressed uint32_t values: INDEX_BUCKET_EMPTY,
+// INDEX_BUCKET_TOMBSTONE or block * DIRECTORY_SLOT_STRIDE + slot + 1 of the
+// entry whose name hashes there
+#define INDEX_BUCKET_EMPTY 0x00000000
+#define INDEX_BUCKET_TOMBSTONE 0xFFFFFFFF
+#define DIRECTORY_SLOT_STRIDE 64
+static_assert(BlockGeometry<BLOCK_SIZE_4096>::entriesPerBlock <= DIRECTORY_SLOT_STRIDE, "Slot indexes must fit the stride");
+
+// Location of a directory entry
+typedef struct DirectorySlot {
+    uint32_t block;
+    uint32_t index;
+} DirectorySlot;
+
+// Result of resolving a path: the directory holding its last component and,
+// when that component exists, its entry and slot. name views into the path.
+typedef struct ResolvedPath {
+    uint32_t parentBlock;
+    string_view name; // Last component, empty for the root directory
+    bool found;
+    DirectoryEntry entry;
+    DirectorySlot slot;
+} ResolvedPath;
+
+// LRU cache of (parent directory block, name) -> slot of the named entry.
+// Hits are checked against the slot's current contents, and add/remove/
+// release of directory entries keep it coherent.
+#define DENTRY_CACHE_CAPACITY 1024
+typedef struct DentryCacheNode {
+    uint64_t key; // parentBlock << 32 | hash of name
+    string name;
+    DirectorySlot slot;
+} DentryCacheNode;
+
+typedef struct DentryCache {
+    size_t capacity;
+    list<DentryCacheNode> lru; // Most recently used first
+    unordered_map<uint64_t, list<DentryCacheNode>::iterator> nodes;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t invalidations;
+} DentryCache;
+
+// Image storage backends. STORAGE_MMAP maps the whole image and accesses
+// blocks in place; STORAGE_PREAD issues positioned reads/writes on the fd.
+typedef enum StorageBackend {
+    STORAGE_MMAP,
+    STORAGE_PREAD
+} StorageBackend;
+
+// I/O issued against the image, counted by the storage layer. Atomic because
+// reader threads share one ImageStorage.
+typedef struct IoCounters {
+    atomic<uint64_t> reads;
+    atomic<uint64_t> writes;
+    atomic<uint64_t> bytesRead;
+    atomic<uint64_t> bytesWritten;
+    atomic<uint64_t> seeks; // Accesses that do not start where the previous one ended
+    atomic<uint64_t> syncs;
+    atomic<uint64_t> nextOffset;
+} IoCounters;
+
+typedef struct ImageStorage {
+    int fd;
+    StorageBackend backend;
+    uint8_t *mapping; // Whole image when backend == STORAGE_MMAP, otherwise null
+    uint64_t size;
+    IoCounters io;
+} ImageStorage;
+
+// Image byte range changed by the operations of the open journal group
+typedef struct JournalRange {
+    uint64_t offset;
+    uint64_t length;
+} JournalRange;
+
+typedef struct JournalState {
+    vector<JournalRange> pending; // Merged and sorted when the group is encoded
+    uint64_t pendingBytes;        // Upper bound of the group's encoded size, kept as ranges are added
+    uint32_t sequence;            // Sequence of the last committed group
+    uint32_t groupOperations;     // Operations in the open group
+    uint64_t commits;
+    uint64_t bytesLogged;
+    uint64_t earlyCommits;        // Groups committed mid-operation to stay within the journal
+    uint64_t replays;
+    vector<uint32_t> pendingFrees; // Blocks freed in the open group, still marked used until it commits
+} JournalState;
+
+// Write-back cache of image blocks used with the pread backend (with mmap
+// the page cache already plays this role). Accesses inside one block are
+// served from and loaded into the cache; longer data transfers only use
+// blocks that are already cached and go straight to the image otherwise.
+// Dirty blocks are written back on eviction and by syncSession().
+// Whatever the budget, journaledWrite() stages its changes here as well, so
+// with mmap or a zero budget the cache holds just the open group's blocks.
+#define BLOCK_CACHE_DEFAULT_BYTES (256 * 1024)
+typedef struct CachedBlock {
+    uint32_t block;
+    bool dirty;
+    bool journaled; // Holds uncommitted journaled changes, must not be evicted
+    vector<uint8_t> data;
+} CachedBlock;
+
+typedef struct BlockCache {
+    size_t budget; // Bytes of block data the cache may hold, 0 disables it
+    list<CachedBlock> lru; // Most recently used first
+    unordered_map<uint32_t, list<CachedBlock>::iterator> blocks;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t writebacks;
+} BlockCache;
+
+// Per operation type instrumentation. Latency bucket b counts operations
+// that took [2^b, 2^(b+1)) microseconds; bucket 0 also holds anything faster.
+#define LATENCY_BUCKETS 32
+typedef struct OperationStats {
+    uint64_t count;
+    uint64_t failures;
+    double totalMicros;
+    uint64_t latency[LATENCY_BUCKETS];
+
+    // Work done on behalf of the operations
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t bytesRead;
+    uint64_t bytesWritten;
+    uint64_t seeks;
+    uint64_t syncs;
+    uint64_t fatFlushes;
+    uint64_t bitmapFlushes;
+    uint64_t directoryBlocksScanned;
+    uint64_t journalCommits;
+} OperationStats;
+
+// Run of physically consecutive blocks
+typedef struct BlockRun {
+    uint32_t start;
+    uint32_t length;
+} BlockRun;
+
+// LRU cache of file chain indexes keyed by first block: the runs of the
+// chain with the file block each run starts at, so the run holding an
+// offset is found by binary search instead of walking the FAT. A node is
+// rebuilt when the file size changes and dropped when its chain is released.
+#define CHAIN_INDEX_CACHE_CAPACITY 256
+typedef struct ChainIndexNode {
+    uint32_t firstBlock;
+    uint32_t fileSize;           // Size the chain was indexed for
+    vector<BlockRun> runs;
+    vector<uint32_t> runStarts;  // File block number of each run's first block
+} ChainIndexNode;
+
+typedef struct ChainIndexCache {
+    size_t capacity; // Files
+    list<ChainIndexNode> lru; // Most recently used first
+    unordered_map<uint32_t, list<ChainIndexNode>::iterator> nodes;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t invalidations;
+} ChainIndexCache;
+
+struct FileSystemSession;
+
+// Scans over one directory block, instantiated per block size and picked
+// once by openSession(). first skips the header slot; findName and findFree
+// return the slot index or -1, and findFree only looks below limit.
+typedef struct DirectoryOps {
+    int (*findName)(FileSystemSession &session, uint32_t block, uint32_t first, string_view name, DirectoryEntry &entry);
+    int (*findFree)(FileSystemSession &session, uint32_t block, uint32_t first, uint32_t limit);
+    void (*collect)(FileSystemSession &session, uint32_t block, uint32_t first, vector<DirectoryEntry> &entries,
+                    vector<DirectorySlot> *slots);
+} DirectoryOps;
+
+// Open file system image with its metadata resident in memory. Operations
+// update superBlock/free_blocks/fat in place and record the touched
+// METADATA_SECTOR_SIZE sectors in dirtySectors; only those sectors are
+// written back by syncSession() or closeSession(). free_blocks and fat point
+// into metadataBuffer with either backend, never into the mapping.
+//
+// A session may be shared by threads. Operations that only read the image
+// hold metadataLock shared and may run concurrently; operations that change
+// it hold it exclusively. cacheMutex protects the dentry, chain index and
+// block caches, which readers also update, and is always taken inside
+// metadataLock.
+typedef struct FileSystemSession {
+    ImageStorage storage;
+    string imagePath;
+    SuperBlock superBlock;
+    uint32_t blockShift; // log2(superBlock.blockSize), for block offsets
+    const DirectoryOps *directoryOps; // Instantiated for superBlock.blockSize
+    uint8_t *free_blocks;
+    uint8_t *fat; // superBlock.fatEntrySize bytes per entry, see readFAT12Entry()
+    vector<uint8_t> metadataBuffer; // Private copy of the metadata region
+    vector<uint64_t> dirtySectors;  // One bit per metadata sector
+    bool metadataDirty;
+
+    // Block allocator state, derived from free_blocks at open time
+    uint32_t allocationCursor; // Next-fit position for the next allocation
+    uint32_t freeBlockCount;
+
+    // Metadata write accounting
+    uint64_t metadataBytesWritten;
+    uint64_t metadataWrites;
+    uint64_t operationCount;
+
+    // Data read accounting
+    atomic<uint64_t> fileReads;
+    atomic<uint64_t> dataReadCalls;
+    atomic<uint64_t> dataBytesRead;
+
+    DentryCache dentries;
+    ChainIndexCache chainIndexes;
+    BlockCache blockCache;
+    JournalState journal;
+
+    shared_mutex metadataLock;
+    mutex cacheMutex;
+    unsigned workerThreads; // Threads for parallel operations, 0 for one per core
+
+    // Instrumentation: totals since open and per operation type
+    uint64_t fatFlushes;
+    uint64_t bitmapFlushes;
+    atomic<uint64_t> directoryBlocksScanned;
+    map<string, OperationStats> operationStats;
+    string currentOperation; // Empty outside beginOperation()/completeOperation()
+    OperationStats operationStart;
+    chrono::steady_clock::time_point operationStartTime;
+} FileSystemSession;
 
 // Function prototypes
-void initializeSuperBlock(SuperBlock &superBlock, uint32_t blockSize);
+bool initializeSuperBlock(SuperBlock &superBlock, uint32_t blockSize, uint32_t totalBlocks);
+bool validSuperBlock(const SuperBlock &superBlock, uint64_t imageSize);
+size_t superBlockSize(const SuperBlock &superBlock);
+uint32_t bitmapSize(const SuperBlock &superBlock);
 void writeSuperBlock(std::ofstream &file, SuperBlock &superBlock);
-void writeSuperBlock(std::fstream &file, SuperBlock &superBlock);
+void writeSuperBlock(ImageStorage &storage, SuperBlock &superBlock);
 void readSuperBlock(std::ifstream &file, SuperBlock &superBlock);
-void readSuperBlock(std::fstream &file, SuperBlock &superBlock);
-void initializeFreeBlocks(uint8_t *free_blocks);
-void writeFreeBlocks(std::ofstream &file, uint8_t *free_blocks);
-void writeFreeBlocks(std::fstream &file, uint8_t *free_blocks);
-void readFreeBlocks(std::ifstream &file, uint8_t *free_blocks);
-void readFreeBlocks(std::fstream &file, uint8_t *free_blocks);
-void initializeFAT12(FAT12Entry *fat);
-void writeFAT12(std::ofstream &file, FAT12Entry *fat);
-void writeFAT12(std::fstream &file, FAT12Entry *fat);
-void readFAT12(std::ifstream &file, FAT12Entry *fat);
-void readFAT12(std::fstream &file, FAT12Entry *fat);
-uint32_t readFAT12Entry(const FAT12Entry *fat, uint32_t currentBlock);
-vector<DirectoryEntry> readDirectoryEntries(fstream &file, uint32_t block);
-int findFreeBlock(uint8_t *free_blocks);
+void readSuperBlock(ImageStorage &storage, SuperBlock &superBlock);
+void initializeFreeBlocks(uint8_t *free_blocks, const SuperBlock &superBlock);
+void writeFreeBlocks(std::ofstream &file, const uint8_t *free_blocks, const SuperBlock &superBlock);
+void writeFreeBlocks(ImageStorage &storage, const uint8_t *free_blocks, const SuperBlock &superBlock);
+void readFreeBlocks(std::ifstream &file, uint8_t *free_blocks, const SuperBlock &superBlock);
+void readFreeBlocks(ImageStorage &storage, uint8_t *free_blocks, const SuperBlock &superBlock);
+void initializeFAT12(uint8_t *fat, const SuperBlock &superBlock);
+void writeFAT12(std::ofstream &file, const uint8_t *fat, const SuperBlock &superBlock);
+void writeFAT12(ImageStorage &storage, const uint8_t *fat, const SuperBlock &superBlock);
+void readFAT12(std::ifstream &file, uint8_t *fat, const SuperBlock &superBlock);
+void readFAT12(ImageStorage &storage, uint8_t *fat, const SuperBlock &superBlock);
+uint32_t entryFirstBlock(const SuperBlock &superBlock, const DirectoryEntry &entry);
+void setEntryFirstBlock(const SuperBlock &superBlock, DirectoryEntry &entry, uint32_t block);
+string directoryEntryName(const DirectoryEntry &entry);
+bool directoryEntryNameEquals(const DirectoryEntry &entry, string_view name);
+
+// Storage backend
+bool openStorage(ImageStorage &storage, const string &fileSystemFile, StorageBackend backend);
+bool storageRead(ImageStorage &storage, uint64_t offset, void *buffer, size_t length);
+bool storageWrite(ImageStorage &storage, uint64_t offset, const void *buffer, size_t length);
+uint8_t *storagePointer(ImageStorage &storage, uint64_t offset, size_t length);
+int storageSync(ImageStorage &storage);
+void closeStorage(ImageStorage &storage);
+
+// Directory layer
+vector<DirectoryEntry> readDirectoryEntries(FileSystemSession &session, uint32_t block);
+void directoryChain(const FileSystemSession &session, uint32_t firstBlock, vector<uint32_t> &blocks);
+bool readDirectoryHeader(FileSystemSession &session, uint32_t dirBlock, DirectoryHeader &header);
+bool initializeDirectoryBlock(FileSystemSession &session, uint32_t block, bool withHeader);
+void listDirectory(FileSystemSession &session, uint32_t dirBlock, vector<DirectoryEntry> &entries, vector<DirectorySlot> *slots = nullptr);
+bool findDirectoryEntry(FileSystemSession &session, uint32_t dirBlock, string_view name, DirectoryEntry &entry, DirectorySlot &slot);
+bool writeDirectoryEntry(FileSystemSession &session, const DirectorySlot &slot, const DirectoryEntry &entry);
+bool addDirectoryEntry(FileSystemSession &session, uint32_t dirBlock, const DirectoryEntry &entry);
+bool removeDirectoryEntry(FileSystemSession &session, uint32_t dirBlock, const DirectorySlot &slot);
+void releaseDirectory(FileSystemSession &session, uint32_t dirBlock);
+
+// Path resolution
+bool nextPathComponent(string_view path, size_t &position, string_view &component);
+int resolvePath(FileSystemSession &session, string_view path, ResolvedPath &resolved);
+
+// Session management
+bool openSession(FileSystemSession &session, const string &fileSystemFile, StorageBackend backend = STORAGE_MMAP,
+                 size_t cacheBytes = BLOCK_CACHE_DEFAULT_BYTES);
+void markMetadataDirty(FileSystemSession &session, uint64_t offset, size_t length);
+uint32_t readFAT12Entry(const FileSystemSession &session, uint32_t block);
+void setFATEntry(FileSystemSession &session, uint32_t block, FAT12Entry value);
+void setBlockFree(FileSystemSession &session, uint32_t block, bool isFree);
+
+// Block cache in front of the image's data area
+bool blockCacheRead(FileSystemSession &session, uint64_t offset, void *buffer, size_t length);
+bool blockCacheWrite(FileSystemSession &session, uint64_t offset, const void *buffer, size_t length);
+int flushBlockCache(FileSystemSession &session);
+
+// Metadata journal
+bool journaledWrite(FileSystemSession &session, uint64_t offset, const void *buffer, size_t length);
+int commitJournal(FileSystemSession &session);
+
+// Operation boundaries and instrumentation
+void beginOperation(FileSystemSession &session, const string &name);
+int completeOperation(FileSystemSession &session, int result = 0);
+
+// Block allocator over the free block bitmap
+void initializeAllocator(FileSystemSession &session);
+int findFreeBlock(const FileSystemSession &session);
+int allocateBlock(FileSystemSession &session);
+bool allocateBlocks(FileSystemSession &session, uint32_t count, vector<uint32_t> &blocks);
+bool allocateExtents(FileSystemSession &session, uint32_t count, vector<uint32_t> &blocks);
+void collectFreeRuns(const FileSystemSession &session, vector<BlockRun> &runs);
+void collectChainRuns(const FileSystemSession &session, uint32_t firstBlock, uint64_t byteCount, vector<BlockRun> &runs);
+void releaseBlock(FileSystemSession &session, uint32_t block);
+void releaseChain(FileSystemSession &session, uint32_t firstBlock);
+void releaseChains(FileSystemSession &session, const vector<uint32_t> &firstBlocks);
+int syncSession(FileSystemSession &session);
+int closeSession(FileSystemSession &session);
+void printSessionStats(const FileSystemSession &session, ostream &out = cout);
+void printSessionStatsJson(const FileSystemSession &session, ostream &out = cout);
+
+// Operations on an open session
+int chmod(FileSystemSession &session, const string &path, bool readPermission, bool writePermission);
+int addpw(FileSystemSession &session, const string &path, const string &password);
+int mkdir(FileSystemSession &session, const string &path);
+void dir(FileSystemSession &session, const string &path);
+int rmdir(FileSystemSession &session, const string &path);
+int rm(FileSystemSession &session, const string &path, bool recursive);
+int defrag(FileSystemSession &session, uint64_t budgetBytes);
+int fsck(FileSystemSession &session, bool repair);
+int dumpe2fs(FileSystemSession &session);
+int readFile(FileSystemSession &session, const string &path);
+int readFileRange(FileSystemSession &session, const string &path, uint64_t offset, uint64_t length, vector<uint8_t> &data);
+int catFile(FileSystemSession &session, const string &path, int outFd);
+int writeFile(FileSystemSession &session, const string &path, const vector<uint8_t> &data);
+int writeFileFromFd(FileSystemSession &session, const string &path, int inFd);
+int writeFileFromHost(FileSystemSession &session, const string &path, const string &hostFile);
+int appendFile(FileSystemSession &session, const string &path, const vector<uint8_t> &data);
+int writeFileAt(FileSystemSession &session, const string &path, uint64_t offset, const vector<uint8_t> &data);
+int importTree(FileSystemSession &session, const string &hostDir, const string &path);
+
+// File to copy out of the image by extractFiles()
+typedef struct ExtractRequest {
+    string path;     // Path inside the image
+    string hostFile; // Destination on the host, parent directories are created
+} ExtractRequest;
+
+// Copies files out of the image on session.workerThreads reader threads
+int extractFiles(FileSystemSession &session, const vector<ExtractRequest> &files);
+int exportTree(FileSystemSession &session, const string &path, const string &hostDir);
+
+// How makeFileSystem() provides the data blocks: left as a hole in the image
+// file, reserved with fallocate (sparse where unsupported), or zeroed
+typedef enum FormatMode {
+    FORMAT_SPARSE,
+    FORMAT_ALLOCATE,
+    FORMAT_ZERO
+} FormatMode;
+
+// Creates a fresh image of totalBlocks blocks, DEFAULT_IMAGE_SIZE bytes when
+// 0; the library entry point behind makeFileSystem
+int makeFileSystem(const string &fileSystemFile, uint32_t blockSize, uint32_t totalBlocks = 0, FormatMode mode = FORMAT_SPARSE);
+
+// Executes one command per line against an open session (batch/shell mode)
+int runBatch(FileSystemSession &session, istream &commands, bool interactive);
 
 #endif // FAT12_FILE_SYSTEM_H